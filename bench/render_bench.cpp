@@ -0,0 +1,252 @@
+/*
+ * xlaserpointer
+ * Headless renderer benchmark. Replays a pointer trace through the trail
+ * bookkeeping and draw() onto a cairo image surface, frame by frame, which is
+ * the per-frame work of the cairo and shm backends without an X server.
+ *
+ * Copyright (C) 2020, Naomi Alterman
+ *
+ * Licensed under the MIT license; see src/main.cpp for the full text.
+ */
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "argagg.hpp"
+
+#include "draw.hpp"
+#include "trail.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+struct Resolution {
+   int w, h;
+};
+
+std::vector<std::string> split_list(const std::string &list) {
+   std::vector<std::string> items;
+   std::stringstream stream(list);
+   std::string item;
+   while (std::getline(stream, item, ',')) {
+      if (!item.empty()) {
+         items.push_back(item);
+      }
+   }
+   return items;
+}
+
+// Traces are plain text, one sample per line: "<time in ms> <x> <y>"
+bool load_trace(const std::string &path, std::vector<Sample> &trace) {
+   std::ifstream file(path);
+   if (!file) {
+      return false;
+   }
+   Sample sample;
+   while (file >> sample.time >> sample.x >> sample.y) {
+      trace.push_back(sample);
+   }
+   return !trace.empty();
+}
+
+// Five seconds of a 1000Hz mouse sweeping a figure-eight across most of the
+// screen, with a pause every second so the trail also gets to fade out
+std::vector<Sample> synthetic_trace(const Resolution &res) {
+   std::vector<Sample> trace;
+   for (uint32_t t = 0; t < 5000; t++) {
+      if (t % 1000 >= 800) {
+         continue;
+      }
+      double phase = t / 1000.0;
+      int x = (int) (res.w / 2 + res.w * 0.4 * std::sin(2 * M_PI * phase / 1.7));
+      int y = (int) (res.h / 2 + res.h * 0.4 * std::sin(4 * M_PI * phase / 1.7));
+      trace.push_back({x, y, t});
+   }
+   return trace;
+}
+
+struct Result {
+   size_t frames;
+   double mean, p50, p99, max;
+};
+
+// Each extra pointer replays the same trace this much later, so that the
+// pointers are spread out along it
+const uint32_t pointer_lag_ms = 250;
+
+Result replay(const std::vector<Sample> &trace, const Resolution &res,
+              const PointerStyle &style, int pointers, double fps, bool full_repaint) {
+   cairo_surface_t *surf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, res.w, res.h);
+   cairo_t *cr = cairo_create(surf);
+
+   static const Color colors[] = {{1, 0, 0, 1}, {0, 0.5, 1, 1}, {0, 0.75, 0, 1}};
+   std::vector<Trail> trails(pointers);
+   std::vector<size_t> next(pointers, 0);
+   for (int p = 0; p < pointers; p++) {
+      trails[p].deviceid = p;
+      trails[p].style = style;
+      trails[p].style.color = colors[p % 3];
+   }
+   Rect screen = {0, 0, res.w, res.h};
+   std::vector<Rect> damage;
+   std::vector<double> frame_us;
+
+   uint32_t start = trace.front().time;
+   uint32_t end = trace.back().time + (pointers - 1) * pointer_lag_ms + style.trail_ms;
+   for (double t = start; t <= end; t += 1000.0 / fps) {
+      uint32_t now = (uint32_t) t;
+      Clock::time_point frame_start = Clock::now();
+
+      for (int p = 0; p < pointers; p++) {
+         uint32_t lag = p * pointer_lag_ms;
+         while (next[p] < trace.size() && trace[next[p]].time + lag <= now) {
+            Sample sample = trace[next[p]++];
+            sample.time += lag;
+            record_sample(trails[p].history, sample, style);
+         }
+         expire_samples(trails[p].history, now, style);
+      }
+      damage.clear();
+      for (Trail &trail : trails) {
+         add_trail_damage(trail, now, damage);
+      }
+      if (full_repaint) {
+         damage.assign(1, screen);
+      }
+      if (!damage.empty()) {
+         draw(cr, trails, now, damage);
+      }
+      cairo_surface_flush(surf);
+
+      frame_us.push_back(std::chrono::duration<double, std::micro>(
+         Clock::now() - frame_start).count());
+   }
+
+   cairo_destroy(cr);
+   cairo_surface_destroy(surf);
+
+   Result result;
+   result.frames = frame_us.size();
+   double total = 0;
+   for (double us : frame_us) {
+      total += us;
+   }
+   result.mean = total / frame_us.size();
+   std::sort(frame_us.begin(), frame_us.end());
+   result.p50 = frame_us[frame_us.size() / 2];
+   result.p99 = frame_us[std::min(frame_us.size() - 1, frame_us.size() * 99 / 100)];
+   result.max = frame_us.back();
+   return result;
+}
+
+int main(int argc, const char **argv) {
+   argagg::parser argparser {{
+      { "help", {"-h", "--help"},
+      "shows this help message", 0},
+      { "trail", {"-t", "--trail"},
+      "comma-separated trail lengths to try, in hundredths of a second "
+      "(default: 10,50,200)", 1},
+      { "size", {"-s", "--size"},
+      "comma-separated pointer radii to try, in pixels (default: 7,20)", 1},
+      { "resolution", {"-r", "--resolution"},
+      "comma-separated surface sizes to try, as WxH "
+      "(default: 1920x1080,3840x2160)", 1},
+      { "trace", {"--trace"},
+      "replay a recorded trace instead of a synthetic one; one sample per "
+      "line as \"<time in ms> <x> <y>\"", 1},
+      { "fps", {"--fps"},
+      "frame rate to replay the trace at (default: 60)", 1},
+      { "pointers", {"-p", "--pointers"},
+      "comma-separated numbers of pointers (as with MPX) to try, each "
+      "replaying the trace a little behind the last (default: 1)", 1},
+      { "full", {"--full"},
+      "clear and repaint the whole surface every frame instead of only the "
+      "damaged area", 0},
+   }};
+   argagg::parser_results args;
+   try {
+      args = argparser.parse(argc, argv);
+   } catch (const std::exception& e) {
+      std::cerr << e.what() << '\n';
+      return EXIT_FAILURE;
+   }
+
+   if (args["help"]) {
+      argagg::fmt_ostream fmt(std::cerr);
+      fmt << "Usage: xlaserpointer_bench [options]\n" <<
+             "Measure the cost of drawing the pointer trail offscreen\n" << argparser;
+      return EXIT_SUCCESS;
+   }
+
+   std::vector<int> trails;
+   std::vector<double> sizes;
+   std::vector<Resolution> resolutions;
+   std::vector<int> pointer_counts;
+   double fps = 60;
+   try {
+      for (const std::string &item : split_list(args["trail"].as<std::string>("10,50,200"))) {
+         trails.push_back(std::stoi(item));
+      }
+      for (const std::string &item : split_list(args["size"].as<std::string>("7,20"))) {
+         sizes.push_back(std::stod(item));
+      }
+      for (const std::string &item :
+           split_list(args["resolution"].as<std::string>("1920x1080,3840x2160"))) {
+         Resolution res;
+         if (sscanf(item.c_str(), "%dx%d", &res.w, &res.h) != 2 || res.w < 1 || res.h < 1) {
+            throw std::exception();
+         }
+         resolutions.push_back(res);
+      }
+      for (const std::string &item : split_list(args["pointers"].as<std::string>("1"))) {
+         pointer_counts.push_back(std::stoi(item));
+         if (pointer_counts.back() < 1) {
+            throw std::exception();
+         }
+      }
+      fps = args["fps"].as<double>(60);
+      if (fps <= 0) {
+         throw std::exception();
+      }
+   } catch (const std::exception& e) {
+      argagg::fmt_ostream fmt(std::cerr);
+      fmt << "ERROR: Invalid benchmark parameters" << std::endl;
+      return EXIT_FAILURE;
+   }
+
+   std::vector<Sample> recorded;
+   if (args["trace"]) {
+      std::string path = args["trace"];
+      if (!load_trace(path, recorded)) {
+         argagg::fmt_ostream fmt(std::cerr);
+         fmt << "ERROR: Could not read trace " << path << std::endl;
+         return EXIT_FAILURE;
+      }
+   }
+
+   bool full_repaint = args["full"];
+   printf("%-11s %6s %6s %5s %7s %10s %10s %10s %10s\n",
+      "resolution", "trail", "size", "ptrs", "frames",
+      "mean us", "p50 us", "p99 us", "max us");
+   for (const Resolution &res : resolutions) {
+      std::vector<Sample> trace = recorded.empty() ? synthetic_trace(res) : recorded;
+      for (int trail : trails) {
+         for (double size : sizes) {
+            for (int pointers : pointer_counts) {
+               PointerStyle style = {size, {1, 0, 0, 1}, (uint32_t) trail * 10};
+               Result r = replay(trace, res, style, pointers, fps, full_repaint);
+               printf("%5dx%-5d %6d %6.1f %5d %7zu %10.1f %10.1f %10.1f %10.1f\n",
+                  res.w, res.h, trail, size, pointers, r.frames,
+                  r.mean, r.p50, r.p99, r.max);
+            }
+         }
+      }
+   }
+   return 0;
+}
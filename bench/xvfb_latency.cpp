@@ -0,0 +1,261 @@
+/*
+ * xlaserpointer
+ * End-to-end latency benchmark. Starts xlaserpointer on the current display
+ * (meant to be a private Xvfb, see xvfb_latency.sh), moves the pointer with
+ * XTest and times how long it takes for the laser pointer to show up under
+ * it, by reading the screen back. Also reports how much CPU xlaserpointer
+ * used while doing so, per frame drawn (as counted by its --stats) and per
+ * move.
+ *
+ * Copyright (C) 2020, Naomi Alterman
+ *
+ * Licensed under the MIT license; see src/main.cpp for the full text.
+ */
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XTest.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "argagg.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+Display *open_display(double timeout_s) {
+   // Xvfb may still be starting up
+   Clock::time_point give_up = Clock::now() +
+      std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(timeout_s));
+   while (true) {
+      if (Display *d = XOpenDisplay(NULL)) {
+         return d;
+      }
+      if (Clock::now() > give_up) {
+         return NULL;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+   }
+}
+
+// Starts xlaserpointer with its stderr, where --stats reports go, on a pipe
+pid_t spawn(const std::vector<const char *> &command, FILE *&child_stderr) {
+   int fds[2];
+   if (pipe(fds) < 0) {
+      return -1;
+   }
+   pid_t pid = fork();
+   if (pid == 0) {
+      dup2(fds[1], STDERR_FILENO);
+      close(fds[0]);
+      close(fds[1]);
+      std::vector<char *> argv;
+      for (const char *arg : command) {
+         argv.push_back((char *) arg);
+      }
+      argv.push_back(NULL);
+      execv(argv[0], argv.data());
+      perror("Could not start xlaserpointer");
+      _exit(EXIT_FAILURE);
+   }
+   close(fds[1]);
+   child_stderr = fdopen(fds[0], "r");
+   return pid;
+}
+
+// Reads xlaserpointer's stderr up to its next --stats summary, and returns
+// the number of frames drawn so far, or -1 if it exited first. Anything else
+// it prints is passed on, except the rest of the summary.
+long long read_frame_count(FILE *child_stderr) {
+   char line[512];
+   while (fgets(line, sizeof(line), child_stderr) != NULL) {
+      unsigned long long frames;
+      if (sscanf(line, "xlaserpointer: %llu frames", &frames) == 1) {
+         return (long long) frames;
+      }
+      if (strncmp(line, "  ", 2) != 0) {
+         fputs(line, stderr);
+      }
+   }
+   return -1;
+}
+
+// User plus system time of a process, in milliseconds
+double cpu_ms(pid_t pid) {
+   std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+   std::string line;
+   std::getline(stat, line);
+   // The command name can contain spaces, so start after its closing paren
+   size_t paren = line.rfind(')');
+   if (paren == std::string::npos) {
+      return 0;
+   }
+   unsigned long utime = 0, stime = 0;
+   sscanf(line.c_str() + paren + 2,
+      "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+   return (utime + stime) * 1000.0 / sysconf(_SC_CLK_TCK);
+}
+
+// Checks for the (default, red) laser pointer at the given root position
+bool pointer_visible(Display *d, int x, int y) {
+   XImage *image = XGetImage(d, DefaultRootWindow(d), x, y, 1, 1, AllPlanes, ZPixmap);
+   if (image == NULL) {
+      return false;
+   }
+   unsigned long pixel = XGetPixel(image, 0, 0);
+   Visual *visual = DefaultVisual(d, DefaultScreen(d));
+   unsigned long r = (pixel & visual->red_mask) >> __builtin_ctzl(visual->red_mask);
+   unsigned long g = (pixel & visual->green_mask) >> __builtin_ctzl(visual->green_mask);
+   unsigned long b = (pixel & visual->blue_mask) >> __builtin_ctzl(visual->blue_mask);
+   XDestroyImage(image);
+   return r > 200 && g < 60 && b < 60;
+}
+
+// Moves the pointer and waits for the laser pointer to follow. Returns the
+// delay in microseconds, or a negative number if it never showed up.
+double measure_move(Display *d, int x, int y, double timeout_s) {
+   Clock::time_point start = Clock::now();
+   XTestFakeMotionEvent(d, DefaultScreen(d), x, y, CurrentTime);
+   XSync(d, false);
+   // Sample just up and to the left of the hotspot, where a visible cursor
+   // would not be in the way
+   while (!pointer_visible(d, x - 3, y - 3)) {
+      if (Clock::now() - start > std::chrono::duration<double>(timeout_s)) {
+         return -1;
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+   }
+   return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+}
+
+int main(int argc, const char **argv) {
+   argagg::parser argparser {{
+      { "help", {"-h", "--help"},
+      "shows this help message", 0},
+      { "moves", {"-n", "--moves"},
+      "number of pointer moves to time (default: 200)", 1},
+      { "interval", {"-i", "--interval"},
+      "milliseconds to wait between moves (default: 50)", 1},
+   }};
+
+   // Everything after "--" is the xlaserpointer command line
+   int own_argc = argc;
+   for (int i = 1; i < argc; i++) {
+      if (strcmp(argv[i], "--") == 0) {
+         own_argc = i;
+         break;
+      }
+   }
+   argagg::parser_results args;
+   try {
+      args = argparser.parse(own_argc, argv);
+   } catch (const std::exception& e) {
+      std::cerr << e.what() << '\n';
+      return EXIT_FAILURE;
+   }
+
+   if (args["help"] || own_argc + 1 >= argc) {
+      argagg::fmt_ostream fmt(std::cerr);
+      fmt << "Usage: xlaserpointer_latency [options] -- <xlaserpointer> [its options]\n" <<
+             "Time how long the laser pointer takes to follow XTest pointer motion.\n" <<
+             "xlaserpointer must draw in its default color with a size of at least 5.\n" <<
+             "--stats is added to its options to count the frames it draws.\n" <<
+             argparser;
+      return args["help"] ? EXIT_SUCCESS : EXIT_FAILURE;
+   }
+
+   int moves = args["moves"].as<int>(200);
+   int interval_ms = args["interval"].as<int>(50);
+
+   Display *d = open_display(5);
+   if (d == NULL) {
+      fprintf(stderr, "ERROR: Could not open display\n");
+      return EXIT_FAILURE;
+   }
+   int unused;
+   if (!XTestQueryExtension(d, &unused, &unused, &unused, &unused)) {
+      fprintf(stderr, "ERROR: XTest extension not available\n");
+      return EXIT_FAILURE;
+   }
+   int screen_w = DisplayWidth(d, DefaultScreen(d));
+   int screen_h = DisplayHeight(d, DefaultScreen(d));
+
+   std::vector<const char *> command(argv + own_argc + 1, argv + argc);
+   command.push_back("--stats");
+   FILE *child_stderr = NULL;
+   pid_t child = spawn(command, child_stderr);
+   if (child < 0) {
+      perror("Could not start xlaserpointer");
+      return EXIT_FAILURE;
+   }
+
+   // The first move doubles as waiting for xlaserpointer to start up
+   if (measure_move(d, screen_w / 2, screen_h / 2, 10) < 0) {
+      fprintf(stderr, "ERROR: xlaserpointer never appeared\n");
+      kill(child, SIGKILL);
+      return EXIT_FAILURE;
+   }
+
+   // Frames are counted from here on, so the startup move isn't included
+   kill(child, SIGUSR1);
+   long long frames_start = read_frame_count(child_stderr);
+
+   std::vector<double> latencies;
+   int misses = 0;
+   double cpu_start = cpu_ms(child);
+   Clock::time_point wall_start = Clock::now();
+   for (int i = 0; i < moves; i++) {
+      // Walk a coarse grid so consecutive targets are far apart and never
+      // land on what's left of the previous trail
+      int x = 50 + (i * 397) % std::max(screen_w - 100, 1);
+      int y = 50 + (i * 211) % std::max(screen_h - 100, 1);
+      double latency = measure_move(d, x, y, 1);
+      if (latency < 0) {
+         misses++;
+      } else {
+         latencies.push_back(latency);
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+   }
+   double wall_ms = std::chrono::duration<double, std::milli>(Clock::now() - wall_start).count();
+   double cpu_used = cpu_ms(child) - cpu_start;
+
+   // xlaserpointer prints a final summary on the way out
+   kill(child, SIGINT);
+   long long frames_end = read_frame_count(child_stderr);
+   waitpid(child, NULL, 0);
+   fclose(child_stderr);
+   XCloseDisplay(d);
+   long long frames = frames_start >= 0 && frames_end >= 0 ? frames_end - frames_start : -1;
+
+   if (latencies.empty()) {
+      fprintf(stderr, "ERROR: The pointer never followed any moves\n");
+      return EXIT_FAILURE;
+   }
+   std::sort(latencies.begin(), latencies.end());
+   printf("motion to pixel: p50 %.2fms, p99 %.2fms, max %.2fms (%zu moves, %d missed)\n",
+      latencies[latencies.size() / 2] / 1000,
+      latencies[std::min(latencies.size() - 1, latencies.size() * 99 / 100)] / 1000,
+      latencies.back() / 1000, latencies.size(), misses);
+   // A single move is followed by a frame for every step of the trail
+   // fading out, so per frame and per move are quite different numbers
+   if (frames > 0) {
+      printf("xlaserpointer CPU: %.3fms per frame (%lld frames), %.2fms per move, "
+         "%.1f%% of one core\n",
+         cpu_used / frames, frames, cpu_used / moves, 100 * cpu_used / wall_ms);
+   } else {
+      printf("xlaserpointer CPU: %.2fms per move, %.1f%% of one core "
+         "(no frame count from --stats)\n",
+         cpu_used / moves, 100 * cpu_used / wall_ms);
+   }
+   return misses == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
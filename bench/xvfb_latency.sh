@@ -0,0 +1,26 @@
+#!/bin/sh
+# Runs the end-to-end latency benchmark against a private Xvfb server, so it
+# works on a machine without a GPU or a desktop session.
+#
+# Usage: bench/xvfb_latency.sh <build dir> [xlaserpointer options]
+#
+# Xvfb has no compositor, so the shape backend is used unless another one is
+# given. Set XVFB_SCREEN to change the screen geometry (default 1920x1080x24).
+set -eu
+
+if [ $# -lt 1 ]; then
+   echo "Usage: $0 <build dir> [xlaserpointer options]" >&2
+   exit 1
+fi
+build=$1
+shift
+if [ $# -eq 0 ]; then
+   set -- --backend shape
+fi
+
+display=:${XVFB_DISPLAY:-97}
+Xvfb "$display" -screen 0 "${XVFB_SCREEN:-1920x1080x24}" -nolisten tcp >/dev/null 2>&1 &
+xvfb=$!
+trap 'kill $xvfb 2>/dev/null' EXIT INT TERM
+
+DISPLAY=$display "$build/xlaserpointer_latency" -- "$build/xlaserpointer" "$@"
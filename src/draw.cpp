@@ -0,0 +1,48 @@
+/*
+ * xlaserpointer
+ * Cairo rendering of the pointer trail.
+ *
+ * Copyright (C) 2020, Naomi Alterman
+ *
+ * Licensed under the MIT license; see main.cpp for the full text.
+ */
+#include "draw.hpp"
+
+#include <cmath>
+
+void draw(cairo_t *cr, const std::vector<Trail> &trails, uint32_t now,
+          const std::vector<Rect> &damage) {
+   cairo_save (cr);
+   for (const Rect &rect : damage) {
+      cairo_rectangle (cr, rect.x, rect.y, rect.w, rect.h);
+   }
+   cairo_clip (cr);
+
+   cairo_set_source_rgba (cr, 0.0, 0.0, 0.0, 0.0);
+   cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+   cairo_paint (cr);
+
+   cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+
+   for (size_t t = 0; t < trails.size(); t++) {
+      const Trail &trail = trails[t];
+      const MotionHistory &history = trail.history;
+      for (size_t i = 0; i < history.size(); i++) {
+         double radius = dot_radius(history, i, now, trail.style);
+         if (radius <= 0) {
+            continue;
+         }
+         const Sample &s = history[i];
+         cairo_move_to (cr, s.x, s.y);
+         cairo_arc (cr, s.x, s.y, radius, 0., 2 * M_PI);
+      }
+
+      const Color &color = trail.style.color;
+      if (t + 1 < trails.size() && color_equal(color, trails[t + 1].style.color)) {
+         continue;
+      }
+      cairo_set_source_rgba(cr, color.r, color.g, color.b, color.a);
+      cairo_fill(cr);
+   }
+   cairo_restore (cr);
+}
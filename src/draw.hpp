@@ -0,0 +1,24 @@
+/*
+ * xlaserpointer
+ * Cairo rendering of the pointer trail.
+ *
+ * Copyright (C) 2020, Naomi Alterman
+ *
+ * Licensed under the MIT license; see main.cpp for the full text.
+ */
+#ifndef XLASERPOINTER_DRAW_HPP
+#define XLASERPOINTER_DRAW_HPP
+
+#include <cairo/cairo.h>
+
+#include "trail.hpp"
+
+// Repaints only the areas in `damage`, which should cover both the trails as
+// they were last drawn and the trails as they are now. Clipping keeps the
+// clear and the fill (and therefore the damage the X server and compositor
+// see) limited to those rectangles instead of the whole overlay. Every trail
+// goes into the same pass, with one fill per run of trails sharing a color.
+void draw(cairo_t *cr, const std::vector<Trail> &trails, uint32_t now,
+          const std::vector<Rect> &damage);
+
+#endif
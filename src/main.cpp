@@ -30,6 +30,11 @@
  */
 #include <assert.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <X11/Xlib.h>
 #include <X11/X.h>
 #include <X11/Xatom.h>
@@ -37,45 +42,126 @@
 #include <X11/extensions/XInput2.h>
 #include <X11/extensions/Xfixes.h>
 #include <X11/extensions/shape.h>
+#include <X11/extensions/Xrender.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xrandr.h>
+#include <X11/extensions/Xpresent.h>
 
 #include <cairo/cairo.h>
 #include <cairo/cairo-xlib.h>
+#include <cairo/cairo-xlib-xrender.h>
 
 #include <string>
 #include <iostream>
-#include <deque>
+#include <cstdint>
+#include <memory>
+#include <unordered_set>
+#include <vector>
 #include <chrono>
-#include <thread>
 #include <cmath>
 #include <csignal>
+#include <algorithm>
+#include <atomic>
 
 #include "argagg.hpp"
 #include "csscolorparser.hpp"
 
+#include "draw.hpp"
+#include "trail.hpp"
+
+enum class Backend {
+   // Antialiased cairo drawing on a 32 bit ARGB window; needs a compositor
+   Cairo,
+   // A solid window cut down to the trail with XShape; works without one
+   Shape,
+   // Pre-rendered dots composited with XRender; needs a compositor
+   XRender,
+   // Cairo drawing into shared memory, uploaded with XShmPutImage
+   Shm,
+};
+
 struct WindowContext {
    Display *d;
    Window root;
-   Window overlay;
-   XVisualInfo vinfo;
    int screen_w, screen_h;
-};
+   int xi_opcode;
+   int randr_event_base;
 
-struct CairoContext {
-   cairo_surface_t* surf;
-   cairo_t* cr;
+   // Everything needed to create overlay windows for the chosen backend
+   Backend backend;
+   XVisualInfo vinfo;
+   Colormap colormap;
+   unsigned long background_pixel;
 };
 
-struct Coordinate {
-   int x, y;
-   bool operator==(const Coordinate& rhs) const {
-       return (x == rhs.x) && (y == rhs.y);
+typedef std::chrono::steady_clock Clock;
+
+// Tracks the offset between the X server's millisecond clock and our own
+// monotonic clock, so the age of a sample can be computed without asking the
+// server what time it is
+struct ServerClock {
+   // The estimate only uses offsets seen in the current and previous window,
+   // so it follows the two clocks drifting apart in either direction
+   static const uint32_t window_ms = 10000;
+
+   bool synced = false;
+   int32_t offset_ms = 0;
+   int32_t window_offset_ms = 0;
+   int32_t previous_offset_ms = 0;
+   uint32_t window_start = 0;
+
+   static uint32_t local_ms() {
+      return (uint32_t) std::chrono::duration_cast<std::chrono::milliseconds>(
+         std::chrono::steady_clock::now().time_since_epoch()).count();
+   }
+
+   // Offsets are compared modulo 2^32, like the clocks themselves
+   static int32_t max_offset(int32_t a, int32_t b) {
+      return (int32_t) ((uint32_t) a - (uint32_t) b) > 0 ? a : b;
    }
-};
 
-struct Color {
-   double r, g, b, a;
+   void observe(uint32_t server_time) {
+      uint32_t local = local_ms();
+      int32_t offset = (int32_t) (server_time - local);
+      if (!synced) {
+         synced = true;
+         window_start = local;
+         window_offset_ms = previous_offset_ms = offset;
+      } else if (local - window_start >= 2 * window_ms) {
+         // Nothing recent to compare against
+         window_start = local;
+         window_offset_ms = previous_offset_ms = offset;
+      } else if (local - window_start >= window_ms) {
+         window_start = local;
+         previous_offset_ms = window_offset_ms;
+         window_offset_ms = offset;
+      } else {
+         window_offset_ms = max_offset(window_offset_ms, offset);
+      }
+      // Events always arrive a little after they were stamped, so the largest
+      // offset seen is the one closest to the truth
+      offset_ms = max_offset(window_offset_ms, previous_offset_ms);
+   }
+
+   uint32_t now() const {
+      return local_ms() + offset_ms;
+   }
 };
 
+// Asks the server what time it is. Appending nothing to a property of a
+// throwaway window still generates a PropertyNotify, stamped with the
+// current server time.
+uint32_t query_server_time(WindowContext &ctx) {
+   Window window = XCreateSimpleWindow(ctx.d, ctx.root, 0, 0, 1, 1, 0, 0, 0);
+   XSelectInput(ctx.d, window, PropertyChangeMask);
+   Atom atom = XInternAtom(ctx.d, "_XLASERPOINTER_TIME", False);
+   XChangeProperty(ctx.d, window, atom, XA_STRING, 8, PropModeAppend, NULL, 0);
+   XEvent event;
+   XWindowEvent(ctx.d, window, PropertyChangeMask, &event);
+   XDestroyWindow(ctx.d, window);
+   return (uint32_t) event.xproperty.time;
+}
+
 WindowContext initialize_xlib(){
    WindowContext ctx;
    if ((ctx.d = XOpenDisplay(NULL)) == NULL) {
@@ -84,140 +170,1552 @@ WindowContext initialize_xlib(){
    
    ctx.root = DefaultRootWindow(ctx.d);
 
+   int unused_event, unused_error;
+   if (!XQueryExtension(ctx.d, "XInputExtension", &ctx.xi_opcode,
+                        &unused_event, &unused_error)) {
+      printf("X Input extension not available, terminating\n");
+      exit(EXIT_FAILURE);
+   }
+
+   if (!XRRQueryExtension(ctx.d, &ctx.randr_event_base, &unused_error)) {
+      ctx.randr_event_base = -1;
+   }
+
    return ctx;
 }
 
-bool shouldExit = false;
+volatile sig_atomic_t shouldExit = false;
+int wakeup_pipe[2] = {-1, -1};
+
+// Pokes the event loop to wake it up immediately, in case there is no mouse
+// movement to otherwise do so. Safe to call from a signal handler.
+void wake_main_loop() {
+   char byte = 0;
+   if (write(wakeup_pipe[1], &byte, 1) < 0) {
+      // Pipe is full, so the loop is already due to wake up
+   }
+}
 
 void signalHandler(int signum) {
    if (shouldExit) {
-      exit(signum);  
+      _exit(signum);
    } else {
       shouldExit = true;
+      wake_main_loop();
+   }
+}
 
-      // Poke the event loop to wake it up immediately, in case there is no
-      // mouse movement to otherwise do so 
-      WindowContext ctx = initialize_xlib();
-      XCreateSimpleWindow(ctx.d, ctx.root, 0, 0, 1, 1, 0, 0, 0);
-      XFlush(ctx.d);
+void initialize_wakeup_pipe() {
+   if (pipe2(wakeup_pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+      perror("Could not create wakeup pipe");
+      exit(EXIT_FAILURE);
    }
 }
 
-void draw(cairo_t *cr, const std::deque<Coordinate> &coords, double size, const Color &color) {
-   cairo_set_source_rgba (cr, 0.0, 0.0, 0.0, 0.0);
-   cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
-   cairo_paint (cr);
+void drain_wakeup_pipe() {
+   char buf[64];
+   while (read(wakeup_pipe[0], buf, sizeof(buf)) > 0) {}
+}
+
+volatile sig_atomic_t shouldDumpStats = false;
 
-   cairo_set_source_rgba(cr, color.r, color.g, color.b, color.a);
-   cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+void statsSignalHandler(int signum) {
+   shouldDumpStats = true;
+   wake_main_loop();
+}
+
+// Fixed-size histogram with four buckets per power of two, so any recorded
+// value is reported to within 25%. Recording is a couple of relaxed atomic
+// adds, and it can be summarized while other threads are still recording.
+class Histogram {
+public:
+   static const int kBuckets = 256;
+
+   void record(uint64_t value) {
+      buckets[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+      total.fetch_add(1, std::memory_order_relaxed);
+      uint64_t seen = maximum.load(std::memory_order_relaxed);
+      while (value > seen &&
+             !maximum.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {}
+   }
 
-   int trail_length = coords.size();
-   double size_step = size/(trail_length+2);
-   double cur_size = size - size_step*trail_length;
-   for (Coordinate c : coords) {
-      cairo_move_to (cr, c.x, c.y);
-      cairo_arc (cr, c.x, c.y, cur_size, 0., 2 * M_PI);
-      if (cur_size < size) {
-         cur_size += size_step;
+   uint64_t count() const {
+      return total.load(std::memory_order_relaxed);
+   }
+
+   uint64_t max() const {
+      return maximum.load(std::memory_order_relaxed);
+   }
+
+   // Upper bound of the bucket holding the given fraction of the samples
+   uint64_t percentile(double fraction) const {
+      uint64_t wanted = (uint64_t) std::ceil(count() * fraction);
+      uint64_t seen = 0;
+      for (int i = 0; i < kBuckets; i++) {
+         seen += buckets[i].load(std::memory_order_relaxed);
+         if (seen >= wanted && seen > 0) {
+            return std::min(bucket_upper_bound(i), max());
+         }
       }
+      return max();
    }
-   cairo_fill(cr);
+
+private:
+   static int bucket_index(uint64_t value) {
+      if (value < 4) {
+         return (int) value;
+      }
+      int octave = 63 - __builtin_clzll(value);
+      int step = (int) (value >> (octave - 2)) & 3;
+      return 4 * (octave - 1) + step;
+   }
+
+   static uint64_t bucket_upper_bound(int index) {
+      if (index < 4) {
+         return index;
+      }
+      int octave = index / 4 + 1;
+      int step = index % 4;
+      return ((uint64_t) (5 + step) << (octave - 2)) - 1;
+   }
+
+   std::atomic<uint64_t> buckets[kBuckets] = {};
+   std::atomic<uint64_t> total{0};
+   std::atomic<uint64_t> maximum{0};
+};
+
+// What --stats collects. Times are in microseconds, though motion to draw
+// comes from server timestamps and so only has millisecond resolution.
+struct FrameStats {
+   Histogram motion_to_draw;
+   Histogram draw_time;
+   Histogram flush_time;
+   Histogram queue_depth;
+   std::atomic<uint64_t> frames{0};
+   std::atomic<uint64_t> restacks{0};
+   std::atomic<uint64_t> idle_us{0};
+   Clock::time_point started = Clock::now();
+};
+
+uint64_t micros_between(Clock::time_point start, Clock::time_point end) {
+   return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+void print_histogram(const char *name, const Histogram &h, double scale, const char *unit) {
+   fprintf(stderr, "  %-16s %10.2f%-2s %10.2f%-2s %10.2f%-2s %10llu\n", name,
+      h.percentile(0.50) * scale, unit,
+      h.percentile(0.99) * scale, unit,
+      h.max() * scale, unit,
+      (unsigned long long) h.count());
 }
 
+void print_stats(const FrameStats &stats) {
+   double elapsed = micros_between(stats.started, Clock::now()) / 1e6;
+   uint64_t frames = stats.frames.load(std::memory_order_relaxed);
+   double idle = stats.idle_us.load(std::memory_order_relaxed) / 1e6;
+   fprintf(stderr, "xlaserpointer: %llu frames in %.1fs (%.1f fps), %.1f%% idle, "
+      "%llu restacks\n",
+      (unsigned long long) frames, elapsed,
+      elapsed > 0 ? frames / elapsed : 0.0,
+      elapsed > 0 ? 100.0 * idle / elapsed : 0.0,
+      (unsigned long long) stats.restacks.load(std::memory_order_relaxed));
+   fprintf(stderr, "  %-16s %12s %12s %12s %10s\n", "", "p50", "p99", "max", "samples");
+   print_histogram("motion to draw", stats.motion_to_draw, 1e-3, "ms");
+   print_histogram("draw", stats.draw_time, 1e-3, "ms");
+   print_histogram("XFlush", stats.flush_time, 1e-3, "ms");
+   print_histogram("event queue", stats.queue_depth, 1, "");
+}
+
+bool compositor_running(WindowContext &ctx) {
+   std::string selection = "_NET_WM_CM_S" + std::to_string(DefaultScreen(ctx.d));
+   Atom atom = XInternAtom(ctx.d, selection.c_str(), false);
+   return XGetSelectionOwner(ctx.d, atom) != None;
+}
 
-void initialize_window(WindowContext &ctx){
+Backend choose_backend(WindowContext &ctx) {
+   XVisualInfo unused;
+   if (compositor_running(ctx) &&
+       XMatchVisualInfo(ctx.d, DefaultScreen(ctx.d), 32, TrueColor, &unused)) {
+      return Backend::Cairo;
+   }
+   return Backend::Shape;
+}
+
+unsigned long alloc_pixel(WindowContext &ctx, const Color &color) {
+   XColor xcolor;
+   xcolor.red = (unsigned short) (color.r * 65535);
+   xcolor.green = (unsigned short) (color.g * 65535);
+   xcolor.blue = (unsigned short) (color.b * 65535);
+   xcolor.flags = DoRed | DoGreen | DoBlue;
+   if (!XAllocColor(ctx.d, DefaultColormap(ctx.d, DefaultScreen(ctx.d)), &xcolor)) {
+      return WhitePixel(ctx.d, DefaultScreen(ctx.d));
+   }
+   return xcolor.pixel;
+}
+
+// Picks the visual for the overlays and selects the events the main loop
+// needs from the root window
+void initialize_root(WindowContext &ctx, Backend backend, const Color &color){
    int default_screen = XDefaultScreen(ctx.d);
 
    ctx.screen_w = DisplayWidth(ctx.d, default_screen);
    ctx.screen_h = DisplayHeight(ctx.d, default_screen);
+   ctx.backend = backend;
 
-   XSetWindowAttributes attrs;
-   attrs.override_redirect = true;
+   if (backend == Backend::Shape) {
+      // The window is painted entirely in the pointer color by the server,
+      // and only its shape changes from frame to frame
+      ctx.vinfo.visual = DefaultVisual(ctx.d, default_screen);
+      ctx.vinfo.depth = DefaultDepth(ctx.d, default_screen);
+      ctx.colormap = DefaultColormap(ctx.d, default_screen);
+      ctx.background_pixel = alloc_pixel(ctx, color);
+   } else {
+      if (!XMatchVisualInfo(ctx.d, DefaultScreen(ctx.d), 32, TrueColor, &ctx.vinfo)) {
+         printf("No visual found supporting 32 bit color, terminating\n");
+         exit(EXIT_FAILURE);
+      }
+      ctx.colormap = XCreateColormap(ctx.d, ctx.root, ctx.vinfo.visual, AllocNone);
+      ctx.background_pixel = 0;
+   }
 
-   if (!XMatchVisualInfo(ctx.d, DefaultScreen(ctx.d), 32, TrueColor, &ctx.vinfo)) {
-      printf("No visual found supporting 32 bit color, terminating\n");
-      exit(EXIT_FAILURE);
+   XSelectInput(ctx.d, ctx.root, SubstructureNotifyMask);
+
+   // Monitors being added, removed or rearranged rebuild the overlays
+   if (ctx.randr_event_base >= 0) {
+      XRRSelectInput(ctx.d, ctx.root, RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask);
    }
-   attrs.colormap = XCreateColormap(ctx.d, ctx.root, ctx.vinfo.visual, AllocNone);
-   attrs.background_pixel = 0;
+
+   // Only master devices are selected: their events carry the same root
+   // coordinates and timestamps as the slave that caused them, without
+   // every motion being reported twice
+   XIEventMask masks[2];
+   masks[0].deviceid = XIAllMasterDevices;
+   masks[0].mask_len = XIMaskLen(XI_LASTEVENT);
+   masks[0].mask = (unsigned char *) calloc(masks[0].mask_len, sizeof(char));
+   XISetMask(masks[0].mask, XI_Motion);
+   XISetMask(masks[0].mask, XI_RawMotion);
+
+   // Master pointers coming and going (MPX) add and remove trails
+   masks[1].deviceid = XIAllDevices;
+   masks[1].mask_len = XIMaskLen(XI_LASTEVENT);
+   masks[1].mask = (unsigned char *) calloc(masks[1].mask_len, sizeof(char));
+   XISetMask(masks[1].mask, XI_HierarchyChanged);
+
+   XISelectEvents(ctx.d, ctx.root, masks, 2);
+
+   free(masks[0].mask);
+   free(masks[1].mask);
+}
+
+Window create_overlay_window(WindowContext &ctx, const Rect &area) {
+   XSetWindowAttributes attrs;
+   attrs.override_redirect = true;
+   attrs.colormap = ctx.colormap;
+   attrs.background_pixel = ctx.background_pixel;
    attrs.border_pixel = 0;
 
-   ctx.overlay = XCreateWindow(
+   Window window = XCreateWindow(
       ctx.d, ctx.root,
-      0, 0, ctx.screen_w, ctx.screen_h, 0,
+      area.x, area.y, area.w, area.h, 0,
       ctx.vinfo.depth, InputOutput, 
       ctx.vinfo.visual,
       CWOverrideRedirect | CWColormap | CWBackPixel | CWBorderPixel, &attrs
    );
 
-   XSelectInput(ctx.d, ctx.root, SubstructureNotifyMask);
-
+   // A solid overlay starts out with an empty bounding shape, so that nothing
+   // shows until the renderer cuts the trail out of it
    XserverRegion region = XFixesCreateRegion(ctx.d, 0, 0);
-   XFixesSetWindowShapeRegion(ctx.d, ctx.overlay, ShapeBounding, 0, 0, 0);
-   XFixesSetWindowShapeRegion(ctx.d, ctx.overlay, ShapeInput, 0, 0, region);
+   XFixesSetWindowShapeRegion(ctx.d, window, ShapeBounding, 0, 0,
+      ctx.backend == Backend::Shape ? region : 0);
+   XFixesSetWindowShapeRegion(ctx.d, window, ShapeInput, 0, 0, region);
    XFixesDestroyRegion(ctx.d, region);
 
-   XIEventMask mask[2];
-   XIEventMask *m;
+   XMapWindow(ctx.d, window);
+   return window;
+}
 
-   m = &mask[0];   
-   m->deviceid = XIAllDevices;
-   m->mask_len = XIMaskLen(XI_LASTEVENT);
-   m->mask = (unsigned char *) calloc(m->mask_len, sizeof(char));
-   XISetMask(m->mask, XI_Motion);
+// Puts the trail on the overlay window. Trail positions and damage are in
+// root window coordinates, whatever the overlay's current position.
+class Renderer {
+public:
+   virtual ~Renderer() {}
 
-   m = &mask[1];
-   m->deviceid = XIAllMasterDevices;
-   m->mask_len = XIMaskLen(XI_LASTEVENT);
-   m->mask = (unsigned char *) calloc(m->mask_len, sizeof(char));
-   XISetMask(m->mask, XI_RawMotion);
+   // Called after the overlay has been moved or resized to `area`
+   virtual void resize(const Rect &area) = 0;
 
-   XISelectEvents(ctx.d, ctx.root, &mask[0], 2);
+   // Draws every trail in one pass, repainting only the rectangles in
+   // `damage`, which all lie within the overlay and don't overlap
+   virtual void draw(const std::vector<Trail> &trails, uint32_t now,
+                     const std::vector<Rect> &damage) = 0;
 
-   XMapWindow(ctx.d, ctx.overlay);
+   // Whether the previous frame is out of the way and a new one can be drawn
+   virtual bool ready() const {
+      return true;
+   }
 
-   XSync(ctx.d, false);
+   // Gives the renderer a look at every X event. Returns true if it was
+   // consumed.
+   virtual bool handle_event(const XEvent &event) {
+      return false;
+   }
+};
+
+class CairoRenderer : public Renderer {
+public:
+   CairoRenderer(WindowContext &ctx, Window window, const Rect &area) {
+      surf = cairo_xlib_surface_create(ctx.d, window,
+         ctx.vinfo.visual, area.w, area.h);
+      cr = cairo_create(surf);
+      cairo_translate(cr, -area.x, -area.y);
+   }
+
+   ~CairoRenderer() {
+      cairo_destroy(cr);
+      cairo_surface_destroy(surf);
+   }
+
+   void resize(const Rect &area) override {
+      cairo_xlib_surface_set_size(surf, area.w, area.h);
+      cairo_identity_matrix(cr);
+      cairo_translate(cr, -area.x, -area.y);
+   }
+
+   void draw(const std::vector<Trail> &trails, uint32_t now,
+             const std::vector<Rect> &damage) override {
+      ::draw(cr, trails, now, damage);
+   }
+
+private:
+   cairo_surface_t *surf;
+   cairo_t *cr;
+};
+
+// Adds a solid disc to `region`, one rectangle per row of pixels
+void region_add_disc(Region region, int cx, int cy, double radius) {
+   int rows = (int) std::ceil(radius);
+   for (int y = cy - rows; y < cy + rows; y++) {
+      double dy = y + 0.5 - cy;
+      double half_width = std::sqrt(std::max(radius*radius - dy*dy, 0.0));
+      int x0 = (int) std::lround(cx - half_width);
+      int x1 = (int) std::lround(cx + half_width);
+      if (x1 > x0) {
+         XRectangle row = {(short) x0, (short) y, (unsigned short) (x1 - x0), 1};
+         XUnionRectWithRegion(&row, region, region);
+      }
+   }
+}
+
+// For X servers without a compositor: the overlay is a plain window filled
+// with the pointer color, and the trail is drawn by setting its bounding
+// shape to the dots. Each frame only the difference from the previous shape
+// is sent to the server. There's no antialiasing or transparency, and since
+// the window has only one color, so do all the pointers' trails.
+class ShapeRenderer : public Renderer {
+public:
+   ShapeRenderer(WindowContext &ctx, Window window, const Rect &area) :
+      d(ctx.d), window(window), area(area), shape(XCreateRegion()) {}
+
+   ~ShapeRenderer() {
+      XDestroyRegion(shape);
+      for (Region disc : discs) {
+         if (disc != NULL) {
+            XDestroyRegion(disc);
+         }
+      }
+   }
+
+   void resize(const Rect &new_area) override {
+      area = new_area;
+      // The server's copy of the shape is relative to the old origin
+      resync = true;
+   }
+
+   void draw(const std::vector<Trail> &trails, uint32_t now,
+             const std::vector<Rect> &damage) override {
+      // Each dot is a copy of a cached disc moved into place, and the copies
+      // are merged pairwise. Adding them one at a time to a single region
+      // would cost time quadratic in the number of dots, since every union
+      // walks the whole region built so far.
+      std::vector<Region> parts;
+      for (const Trail &trail : trails) {
+         const MotionHistory &history = trail.history;
+         for (size_t i = 0; i < history.size(); i++) {
+            double radius = dot_radius(history, i, now, trail.style);
+            if (radius > 0) {
+               Region part = XCreateRegion();
+               XUnionRegion(disc(radius), part, part);
+               XOffsetRegion(part, history[i].x, history[i].y);
+               parts.push_back(part);
+            }
+         }
+      }
+      while (parts.size() > 1) {
+         size_t merged = 0;
+         for (size_t i = 0; i < parts.size(); i += 2) {
+            if (i + 1 < parts.size()) {
+               XUnionRegion(parts[i], parts[i + 1], parts[i]);
+               XDestroyRegion(parts[i + 1]);
+            }
+            parts[merged++] = parts[i];
+         }
+         parts.resize(merged);
+      }
+      Region next = parts.empty() ? XCreateRegion() : parts[0];
 
-   free(mask[0].mask);
-   free(mask[1].mask);
+      if (resync) {
+         XShapeCombineRegion(d, window, ShapeBounding, -area.x, -area.y,
+            next, ShapeSet);
+         resync = false;
+      } else {
+         Region added = XCreateRegion();
+         Region removed = XCreateRegion();
+         XSubtractRegion(next, shape, added);
+         XSubtractRegion(shape, next, removed);
+         if (!XEmptyRegion(removed)) {
+            XShapeCombineRegion(d, window, ShapeBounding, -area.x, -area.y,
+               removed, ShapeSubtract);
+         }
+         if (!XEmptyRegion(added)) {
+            XShapeCombineRegion(d, window, ShapeBounding, -area.x, -area.y,
+               added, ShapeUnion);
+         }
+         XDestroyRegion(added);
+         XDestroyRegion(removed);
+      }
+
+      XDestroyRegion(shape);
+      shape = next;
+   }
+
+private:
+   // A disc centred on the origin, with its radius rounded up to the next
+   // half pixel. Built the first time each size is needed.
+   Region disc(double radius) {
+      size_t level = (size_t) std::ceil(radius * 2);
+      if (level >= discs.size()) {
+         discs.resize(level + 1, NULL);
+      }
+      if (discs[level] == NULL) {
+         discs[level] = XCreateRegion();
+         region_add_disc(discs[level], 0, 0, level / 2.0);
+      }
+      return discs[level];
+   }
+
+   Display *d;
+   Window window;
+   Rect area;
+   // The bounding shape as last sent to the server, in root coordinates
+   Region shape;
+   bool resync = false;
+   std::vector<Region> discs;
+};
+
+// Every dot size the trail can use, pre-rendered with cairo into a single
+// server-side picture. Dot radii are rounded up to the nearest of `levels`
+// evenly spaced sizes.
+struct SpriteAtlas {
+   Pixmap pixmap = None;
+   Picture picture = None;
+   int levels = 0;
+   int columns = 0;
+   // Each sprite is cell x cell pixels, with the dot centred on the corner
+   // between its middle pixels, the same place cairo_arc() puts it
+   int cell = 0;
+   double size = 0;
+   Color color = {0, 0, 0, 0};
+};
+
+// Draws each dot as one XRenderComposite from the sprite atlas, so per-frame
+// work no longer depends on rasterizing the trail's geometry. Unlike a single
+// cairo fill, overlapping translucent dots do build up where they overlap.
+// There is one atlas per trail color in use. Use XRenderRenderer::create(),
+// which returns NULL when the server doesn't support RENDER.
+class XRenderRenderer : public Renderer {
+public:
+   static XRenderRenderer *create(WindowContext &ctx, Window window, const Rect &area) {
+      int unused_event, unused_error;
+      if (!XRenderQueryExtension(ctx.d, &unused_event, &unused_error)) {
+         return NULL;
+      }
+      XRenderPictFormat *format = XRenderFindStandardFormat(ctx.d, PictStandardARGB32);
+      XRenderPictFormat *window_format = XRenderFindVisualFormat(ctx.d, ctx.vinfo.visual);
+      if (format == NULL || window_format == NULL) {
+         return NULL;
+      }
+      return new XRenderRenderer(ctx, window, area, format, window_format);
+   }
+
+   ~XRenderRenderer() {
+      for (SpriteAtlas &atlas : atlases) {
+         free_atlas(atlas);
+      }
+      XRenderFreePicture(d, window_picture);
+   }
+
+   void resize(const Rect &new_area) override {
+      area = new_area;
+   }
+
+   void draw(const std::vector<Trail> &trails, uint32_t now,
+             const std::vector<Rect> &damage) override {
+      drop_unused_atlases(trails);
+
+      // Sprites are composited with Over, so anything already on screen
+      // outside the damaged area must not be drawn over a second time
+      std::vector<XRectangle> clip;
+      for (const Rect &rect : damage) {
+         clip.push_back({(short) (rect.x - area.x), (short) (rect.y - area.y),
+                         (unsigned short) rect.w, (unsigned short) rect.h});
+      }
+      XRenderSetPictureClipRectangles(d, window_picture, 0, 0,
+         clip.data(), (int) clip.size());
+
+      XRenderColor transparent = {0, 0, 0, 0};
+      XRenderFillRectangles(d, PictOpSrc, window_picture, &transparent,
+         clip.data(), (int) clip.size());
+
+      for (const Trail &trail : trails) {
+         const MotionHistory &history = trail.history;
+         const SpriteAtlas &atlas = atlas_for(trail.style);
+         int half = atlas.cell / 2;
+         for (size_t i = 0; i < history.size(); i++) {
+            double radius = dot_radius(history, i, now, trail.style);
+            if (radius <= 0) {
+               continue;
+            }
+            int level = (int) std::ceil(radius / atlas.size * atlas.levels) - 1;
+            level = std::min(std::max(level, 0), atlas.levels - 1);
+            const Sample &s = history[i];
+            XRenderComposite(d, PictOpOver, atlas.picture, None, window_picture,
+               (level % atlas.columns) * atlas.cell, (level / atlas.columns) * atlas.cell,
+               0, 0,
+               s.x - half - area.x, s.y - half - area.y,
+               atlas.cell, atlas.cell);
+         }
+      }
+   }
+
+private:
+   XRenderRenderer(WindowContext &ctx, Window window, const Rect &area,
+                   XRenderPictFormat *format, XRenderPictFormat *window_format) :
+      d(ctx.d), window(window), screen(DefaultScreenOfDisplay(ctx.d)),
+      area(area), format(format) {
+      window_picture = XRenderCreatePicture(d, window, window_format, 0, NULL);
+   }
+
+   static bool atlas_matches(const SpriteAtlas &atlas, const PointerStyle &style) {
+      return atlas.size == style.size && color_equal(atlas.color, style.color);
+   }
+
+   const SpriteAtlas &atlas_for(const PointerStyle &style) {
+      for (const SpriteAtlas &atlas : atlases) {
+         if (atlas_matches(atlas, style)) {
+            return atlas;
+         }
+      }
+      atlases.emplace_back();
+      build_atlas(atlases.back(), style);
+      return atlases.back();
+   }
+
+   // Frees the atlases of pointers that have gone away
+   void drop_unused_atlases(const std::vector<Trail> &trails) {
+      for (size_t i = 0; i < atlases.size();) {
+         bool used = std::any_of(trails.begin(), trails.end(),
+            [&](const Trail &trail) { return atlas_matches(atlases[i], trail.style); });
+         if (used) {
+            i++;
+         } else {
+            free_atlas(atlases[i]);
+            atlases.erase(atlases.begin() + i);
+         }
+      }
+   }
+
+   void build_atlas(SpriteAtlas &atlas, const PointerStyle &style) {
+      atlas.size = style.size;
+      atlas.color = style.color;
+      // Half pixel steps look continuous; past 32 sizes they stop being
+      // distinguishable while the atlas keeps growing
+      atlas.levels = std::min(std::max((int) std::ceil(style.size * 2), 1), 32);
+      atlas.columns = (int) std::ceil(std::sqrt(atlas.levels));
+      atlas.cell = 2 * ((int) std::ceil(style.size) + 1);
+      int rows = (atlas.levels + atlas.columns - 1) / atlas.columns;
+      int width = atlas.columns * atlas.cell;
+      int height = rows * atlas.cell;
+
+      atlas.pixmap = XCreatePixmap(d, window, width, height, 32);
+      cairo_surface_t *surf = cairo_xlib_surface_create_with_xrender_format(
+         d, atlas.pixmap, screen, format, width, height);
+      cairo_t *cr = cairo_create(surf);
+      cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+      cairo_set_source_rgba(cr, 0, 0, 0, 0);
+      cairo_paint(cr);
+
+      const Color &color = style.color;
+      cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+      cairo_set_source_rgba(cr, color.r, color.g, color.b, color.a);
+      for (int level = 0; level < atlas.levels; level++) {
+         double cx = (level % atlas.columns) * atlas.cell + atlas.cell / 2;
+         double cy = (level / atlas.columns) * atlas.cell + atlas.cell / 2;
+         double radius = style.size * (level + 1) / atlas.levels;
+         cairo_move_to(cr, cx, cy);
+         cairo_arc(cr, cx, cy, radius, 0., 2 * M_PI);
+         cairo_fill(cr);
+      }
+      cairo_destroy(cr);
+      cairo_surface_flush(surf);
+      cairo_surface_destroy(surf);
+
+      atlas.picture = XRenderCreatePicture(d, atlas.pixmap, format, 0, NULL);
+   }
+
+   void free_atlas(SpriteAtlas &atlas) {
+      if (atlas.picture != None) {
+         XRenderFreePicture(d, atlas.picture);
+         XFreePixmap(d, atlas.pixmap);
+         atlas.picture = None;
+         atlas.pixmap = None;
+      }
+   }
+
+   Display *d;
+   Window window;
+   Screen *screen;
+   Rect area;
+   XRenderPictFormat *format;
+   Picture window_picture;
+   std::vector<SpriteAtlas> atlases;
+};
+
+bool shm_attach_failed = false;
+
+int trap_shm_attach_error(Display *d, XErrorEvent *error) {
+   shm_attach_failed = true;
+   return 0;
 }
 
-CairoContext initialize_cairo(WindowContext &ctx) {
-   CairoContext cairoCtx;
-   cairoCtx.surf = cairo_xlib_surface_create(ctx.d, ctx.overlay,
-      ctx.vinfo.visual, ctx.screen_w, ctx.screen_h);
-   cairoCtx.cr = cairo_create(cairoCtx.surf);
-   return cairoCtx;
+// Draws with cairo into an image surface backed by a MIT-SHM segment, and
+// uploads only the damaged rectangles with XShmPutImage. On a local server that
+// is a straight copy out of memory we share with it, instead of a stream of
+// rendering requests over the socket. Use ShmRenderer::create(), which
+// returns NULL when shared memory can't be used, e.g. on a remote display.
+class ShmRenderer : public Renderer {
+public:
+   static ShmRenderer *create(WindowContext &ctx, Window window, const Rect &area) {
+      if (!XShmQueryExtension(ctx.d)) {
+         return NULL;
+      }
+      ShmRenderer *renderer = new ShmRenderer(ctx, window, area);
+      if (!renderer->allocate(area.w, area.h)) {
+         delete renderer;
+         return NULL;
+      }
+      return renderer;
+   }
+
+   ~ShmRenderer() {
+      release();
+      XFreeGC(d, gc);
+   }
+
+   void resize(const Rect &new_area) override {
+      area = new_area;
+      if (area.w > image->width || area.h > image->height) {
+         // Leave some room so a growing compact overlay doesn't need a new
+         // segment every frame
+         if (!allocate(area.w * 2, area.h * 2)) {
+            printf("Could not grow shared memory segment, terminating\n");
+            exit(EXIT_FAILURE);
+         }
+      }
+      cairo_identity_matrix(cr);
+      cairo_translate(cr, -area.x, -area.y);
+   }
+
+   void draw(const std::vector<Trail> &trails, uint32_t now,
+             const std::vector<Rect> &damage) override {
+      ::draw(cr, trails, now, damage);
+      cairo_surface_flush(surf);
+
+      Rect visible = {0, 0, area.w, area.h};
+      std::vector<Rect> uploads;
+      for (const Rect &rect : damage) {
+         Rect upload = {rect.x - area.x, rect.y - area.y, rect.w, rect.h};
+         upload = rect_intersect(upload, visible);
+         if (!upload.empty()) {
+            uploads.push_back(upload);
+         }
+      }
+      // Only the last upload asks for a completion event; the server handles
+      // them in order, so it means all of them are done
+      for (size_t i = 0; i < uploads.size(); i++) {
+         const Rect &upload = uploads[i];
+         XShmPutImage(d, window, gc, image, upload.x, upload.y, upload.x, upload.y,
+            upload.w, upload.h, i + 1 == uploads.size());
+         put_pending = true;
+      }
+   }
+
+   bool ready() const override {
+      return !put_pending;
+   }
+
+   bool handle_event(const XEvent &event) override {
+      if (event.type == completion_event &&
+          ((const XShmCompletionEvent &) event).drawable == window) {
+         put_pending = false;
+         return true;
+      }
+      return false;
+   }
+
+private:
+   ShmRenderer(WindowContext &ctx, Window window, const Rect &area) :
+      d(ctx.d), window(window), visual(ctx.vinfo.visual),
+      depth(ctx.vinfo.depth), area(area) {
+      gc = XCreateGC(d, window, 0, NULL);
+      completion_event = XShmGetEventBase(d) + ShmCompletion;
+   }
+
+   bool allocate(int width, int height) {
+      release();
+
+      image = XShmCreateImage(d, visual, depth, ZPixmap, NULL, &shminfo,
+         width, height);
+      if (image == NULL) {
+         return false;
+      }
+      // cairo's ARGB32 is native-endian premultiplied 32 bit pixels, which
+      // is what a 32 bit TrueColor visual on a same-endian server expects
+      uint16_t probe = 1;
+      int native_order = *(unsigned char *) &probe == 1 ? LSBFirst : MSBFirst;
+      if (image->bits_per_pixel != 32 || image->byte_order != native_order ||
+          image->bytes_per_line != cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width)) {
+         release();
+         return false;
+      }
+
+      shminfo.shmid = shmget(IPC_PRIVATE, image->bytes_per_line * image->height,
+         IPC_CREAT | 0600);
+      if (shminfo.shmid < 0) {
+         release();
+         return false;
+      }
+      void *addr = shmat(shminfo.shmid, NULL, 0);
+      if (addr == (void *) -1) {
+         shmctl(shminfo.shmid, IPC_RMID, NULL);
+         release();
+         return false;
+      }
+      shminfo.shmaddr = image->data = (char *) addr;
+      shminfo.readOnly = false;
+
+      // Attaching fails on displays that can't see our memory, which is the
+      // usual way of finding out the server is remote
+      shm_attach_failed = false;
+      XErrorHandler old_handler = XSetErrorHandler(trap_shm_attach_error);
+      XShmAttach(d, &shminfo);
+      XSync(d, false);
+      XSetErrorHandler(old_handler);
+      // The segment goes away once both sides have detached from it
+      shmctl(shminfo.shmid, IPC_RMID, NULL);
+      attached = !shm_attach_failed;
+      if (!attached) {
+         release();
+         return false;
+      }
+
+      surf = cairo_image_surface_create_for_data((unsigned char *) image->data,
+         CAIRO_FORMAT_ARGB32, width, height, image->bytes_per_line);
+      cr = cairo_create(surf);
+      cairo_translate(cr, -area.x, -area.y);
+      return true;
+   }
+
+   void release() {
+      if (cr != NULL) {
+         cairo_destroy(cr);
+         cairo_surface_destroy(surf);
+         cr = NULL;
+         surf = NULL;
+      }
+      if (attached) {
+         // Make sure the server is done reading from the segment
+         XShmDetach(d, &shminfo);
+         XSync(d, false);
+         attached = false;
+         put_pending = false;
+      }
+      if (image != NULL) {
+         if (image->data != NULL) {
+            shmdt(image->data);
+            image->data = NULL;
+         }
+         XDestroyImage(image);
+         image = NULL;
+      }
+   }
+
+   Display *d;
+   Window window;
+   Visual *visual;
+   int depth;
+   Rect area;
+   GC gc;
+   int completion_event;
+
+   XShmSegmentInfo shminfo;
+   XImage *image = NULL;
+   bool attached = false;
+   bool put_pending = false;
+   cairo_surface_t *surf = NULL;
+   cairo_t *cr = NULL;
+};
+
+Renderer *create_renderer(WindowContext &ctx, Window window, const Rect &area) {
+   switch (ctx.backend) {
+   case Backend::Shape:
+      return new ShapeRenderer(ctx, window, area);
+   case Backend::XRender:
+      if (XRenderRenderer *renderer = XRenderRenderer::create(ctx, window, area)) {
+         return renderer;
+      }
+      printf("RENDER not available, falling back to cairo backend\n");
+      ctx.backend = Backend::Cairo;
+      return new CairoRenderer(ctx, window, area);
+   case Backend::Shm:
+      if (ShmRenderer *renderer = ShmRenderer::create(ctx, window, area)) {
+         return renderer;
+      }
+      printf("MIT-SHM not available, falling back to cairo backend\n");
+      ctx.backend = Backend::Cairo;
+      return new CairoRenderer(ctx, window, area);
+   case Backend::Cairo:
+   default:
+      return new CairoRenderer(ctx, window, area);
+   }
+}
+
+// A monitor, as far as RandR is concerned: an active CRTC
+struct Monitor {
+   Rect area;
+   double refresh_rate;
+};
+
+// An overlay window and the renderer drawing on it. Normally there is one per
+// monitor; in compact mode a single one follows the trail around.
+struct Overlay {
+   Window window;
+   Rect area;
+   std::unique_ptr<Renderer> renderer;
+   // Set while all of the overlay needs painting, as when it was just created
+   bool repaint = true;
+};
+
+// Compact mode: keeps the overlay wrapped around the trail, with some slack so
+// that small movements don't need a new window geometry every frame. Returns
+// true if the window was moved or resized, in which case its entire contents
+// need to be repainted.
+bool follow_trail(WindowContext &ctx, Overlay &overlay,
+                  const Rect &bounds, double size) {
+   int margin = std::max(32, (int) std::ceil(size * 4));
+   Rect target = rect_grow(bounds, margin);
+   bool too_small = !rect_contains(overlay.area, bounds);
+   bool too_large = (long) overlay.area.w * overlay.area.h > 4L * target.w * target.h;
+   if (!too_small && !too_large) {
+      return false;
+   }
+
+   overlay.area = target;
+   XMoveResizeWindow(ctx.d, overlay.window,
+      overlay.area.x, overlay.area.y, overlay.area.w, overlay.area.h);
+   overlay.renderer->resize(overlay.area);
+   return true;
 }
 
-Coordinate getPointerCoords(WindowContext &ctx) {
+bool query_pointer_failed = false;
+
+int trap_query_pointer_error(Display *d, XErrorEvent *error) {
+   query_pointer_failed = true;
+   return 0;
+}
+
+// Looks up where a master pointer is, stamping the position with `time`.
+// Device IDs come from queued events, so the device may have been removed
+// (xinput remove-master) by the time the query gets to the server; returns
+// false if so.
+bool query_pointer(WindowContext &ctx, int deviceid, uint32_t time, Sample &sample) {
    Window unused_w;
-   int unused_i;
-   Coordinate current;
-   XQueryPointer(ctx.d, ctx.root,
+   double root_x, root_y, unused_d;
+   XIButtonState buttons;
+   XIModifierState unused_mods;
+   XIGroupState unused_group;
+   // The query waits for its reply, so any error has been handled by the
+   // time it returns
+   query_pointer_failed = false;
+   XErrorHandler old_handler = XSetErrorHandler(trap_query_pointer_error);
+   Bool found = XIQueryPointer(ctx.d, deviceid, ctx.root,
       &unused_w, &unused_w,
-      &current.x, &current.y,
-      &unused_i, &unused_i,
-      (unsigned int *) &unused_i);
-   return current;
+      &root_x, &root_y,
+      &unused_d, &unused_d,
+      &buttons, &unused_mods, &unused_group);
+   XSetErrorHandler(old_handler);
+   if (!found || query_pointer_failed) {
+      return false;
+   }
+   free(buttons.mask);
+   sample = {(int) std::lround(root_x), (int) std::lround(root_y), time};
+   return true;
+}
+
+double mode_refresh_rate(const XRRModeInfo &mode) {
+   double v_total = mode.vTotal;
+   if (mode.modeFlags & RR_DoubleScan) {
+      v_total *= 2;
+   }
+   if (mode.modeFlags & RR_Interlace) {
+      v_total /= 2;
+   }
+   if (mode.hTotal == 0 || v_total == 0) {
+      return 0;
+   }
+   return mode.dotClock / (mode.hTotal * v_total);
+}
+
+// Every active CRTC, minus clones showing the same area. If RandR has nothing
+// to say, the whole screen is treated as one 60Hz monitor.
+std::vector<Monitor> query_monitors(WindowContext &ctx) {
+   std::vector<Monitor> monitors;
+   XRRScreenResources *res = NULL;
+   if (ctx.randr_event_base >= 0) {
+      res = XRRGetScreenResourcesCurrent(ctx.d, ctx.root);
+   }
+   for (int i = 0; res != NULL && i < res->ncrtc; i++) {
+      XRRCrtcInfo *crtc = XRRGetCrtcInfo(ctx.d, res, res->crtcs[i]);
+      if (crtc == NULL) {
+         continue;
+      }
+      if (crtc->mode != None && crtc->width > 0 && crtc->height > 0) {
+         Monitor monitor = {{crtc->x, crtc->y, (int) crtc->width, (int) crtc->height}, 0};
+         for (int m = 0; m < res->nmode; m++) {
+            if (res->modes[m].id == crtc->mode) {
+               monitor.refresh_rate = mode_refresh_rate(res->modes[m]);
+            }
+         }
+         if (monitor.refresh_rate <= 0) {
+            monitor.refresh_rate = 60.0;
+         }
+         bool clone = std::any_of(monitors.begin(), monitors.end(),
+            [&](const Monitor &other) {
+               return rect_equal(other.area, monitor.area);
+            });
+         if (!clone) {
+            monitors.push_back(monitor);
+         }
+      }
+      XRRFreeCrtcInfo(crtc);
+   }
+   if (res != NULL) {
+      XRRFreeScreenResources(res);
+   }
+
+   if (monitors.empty()) {
+      monitors.push_back({{0, 0, ctx.screen_w, ctx.screen_h}, 60.0});
+   }
+   return monitors;
+}
+
+// The monitor showing the given root window position, or the first one if the
+// position is in dead space between monitors
+const Monitor &monitor_at(const std::vector<Monitor> &monitors, int x, int y) {
+   for (const Monitor &monitor : monitors) {
+      if (rect_contains(monitor.area, {x, y, 1, 1})) {
+         return monitor;
+      }
+   }
+   return monitors.front();
+}
+
+// Decides when frames get drawn. With the Present extension the pacer asks
+// for a notification at the next vblank of the CRTC the overlay is on, then
+// draws as late as it safely can before the vblank after that: one frame per
+// refresh, with as little time as possible between reading the trail and the
+// frame being scanned out. Without Present, frames are spaced out at the
+// refresh rate RandR reports.
+class FramePacer {
+public:
+   FramePacer(WindowContext &ctx) : d(ctx.d) {
+      int unused_event, unused_error;
+      use_present = XPresentQueryExtension(d, &present_opcode,
+         &unused_event, &unused_error);
+   }
+
+   // Should be called once for every new overlay window
+   void watch(Window overlay) {
+      if (use_present) {
+         XPresentSelectInput(d, overlay, PresentCompleteNotifyMask);
+      }
+   }
+
+   // Keeps time with the given overlay on `monitor`. In compact mode the one
+   // overlay moves between monitors, so both have to match to carry on.
+   void follow(Window overlay, const Monitor &monitor) {
+      if (overlay == window && rect_equal(monitor.area, monitor_area)) {
+         return;
+      }
+      window = overlay;
+      monitor_area = monitor.area;
+      period = std::chrono::duration_cast<Clock::duration>(
+         std::chrono::duration<double>(1.0 / monitor.refresh_rate));
+      // Vblank counts on another CRTC have nothing to do with this one's
+      last_msc = 0;
+   }
+
+   // There's something new to show, so make sure a frame is on its way
+   void request_frame(Clock::time_point now) {
+      if (state != State::Idle) {
+         return;
+      }
+      if (now - last_frame >= 2 * period) {
+         // Nothing has been drawn for a while, so there's no frame to keep
+         // in step with; get the pointer on screen straight away
+         draw_at = now;
+         state = State::Scheduled;
+      } else if (use_present) {
+         XPresentNotifyMSC(d, window, ++serial, 0, 1, 0);
+         // Should the notification never come (say the overlay got unmapped)
+         // don't let the trail freeze
+         draw_at = now + 2 * period;
+         state = State::WaitingForVblank;
+      } else {
+         draw_at = last_frame + period;
+         state = State::Scheduled;
+      }
+   }
+
+   // Returns true if the event was a vblank notification for the pacer
+   bool handle_event(XEvent &event, Clock::time_point now) {
+      XGenericEventCookie *cookie = &event.xcookie;
+      if (!use_present || cookie->type != GenericEvent ||
+          cookie->extension != present_opcode ||
+          !XGetEventData(d, cookie)) {
+         return false;
+      }
+      if (cookie->evtype == PresentCompleteNotify) {
+         XPresentCompleteNotifyEvent *e = (XPresentCompleteNotifyEvent *) cookie->data;
+         if (e->kind == PresentCompleteKindNotifyMSC && e->serial_number == serial &&
+             state == State::WaitingForVblank) {
+            vblank(e->ust, e->msc, now);
+         }
+      }
+      XFreeEventData(d, cookie);
+      return true;
+   }
+
+   bool due(Clock::time_point now) const {
+      return state != State::Idle && now >= draw_at;
+   }
+
+   // When the loop needs to wake up for the next frame. Returns false if no
+   // frame is wanted.
+   bool next_deadline(Clock::time_point &deadline) const {
+      deadline = draw_at;
+      return state != State::Idle;
+   }
+
+   // How long a refresh of the followed monitor takes
+   Clock::duration frame_period() const {
+      return period;
+   }
+
+   void frame_drawn(Clock::time_point start, Clock::time_point end) {
+      last_frame = end;
+      draw_time = (draw_time * 7 + (end - start)) / 8;
+      state = State::Idle;
+   }
+
+private:
+   void vblank(uint64_t ust, uint64_t msc, Clock::time_point now) {
+      // UST is CLOCK_MONOTONIC in microseconds, the same clock steady_clock
+      // reads on Linux. If the driver disagrees, treat the notification's
+      // arrival as the vblank.
+      Clock::time_point at{std::chrono::microseconds(ust)};
+      if (at > now || now - at > period) {
+         at = now;
+      }
+
+      if (last_msc != 0 && msc > last_msc) {
+         Clock::duration measured = (at - last_vblank) / (long long) (msc - last_msc);
+         if (measured > period / 2 && measured < period * 2) {
+            period = measured;
+         }
+      }
+      last_vblank = at;
+      last_msc = msc;
+
+      // Leave room for drawing and for the compositor to pick the frame up
+      Clock::duration budget = 2 * draw_time + std::chrono::milliseconds(1);
+      draw_at = std::max(at + period - budget, now);
+      state = State::Scheduled;
+   }
+
+   enum class State {
+      Idle,
+      WaitingForVblank,
+      Scheduled,
+   };
+
+   Display *d;
+   Window window = None;
+   Rect monitor_area = {0, 0, 0, 0};
+   bool use_present;
+   int present_opcode = 0;
+   uint32_t serial = 0;
+
+   State state = State::Idle;
+   Clock::duration period = std::chrono::milliseconds(16);
+   Clock::duration draw_time = Clock::duration::zero();
+   Clock::time_point draw_at;
+   Clock::time_point last_frame;
+   Clock::time_point last_vblank;
+   uint64_t last_msc = 0;
+};
+
+std::vector<Overlay> create_overlays(WindowContext &ctx, const std::vector<Monitor> &monitors,
+                                     bool compact, FramePacer &pacer) {
+   std::vector<Rect> areas;
+   if (compact) {
+      // In compact mode the overlay starts out tiny and is moved along with
+      // the trail by follow_trail(), rather than covering a whole monitor
+      areas.push_back({0, 0, 1, 1});
+   } else {
+      for (const Monitor &monitor : monitors) {
+         areas.push_back(monitor.area);
+      }
+   }
+
+   std::vector<Overlay> overlays;
+   for (const Rect &area : areas) {
+      Overlay overlay;
+      overlay.window = create_overlay_window(ctx, area);
+      overlay.area = area;
+      overlay.renderer.reset(create_renderer(ctx, overlay.window, area));
+      pacer.watch(overlay.window);
+      overlays.push_back(std::move(overlay));
+   }
+   XSync(ctx.d, false);
+   return overlays;
+}
+
+void destroy_overlays(WindowContext &ctx, std::vector<Overlay> &overlays) {
+   for (Overlay &overlay : overlays) {
+      overlay.renderer.reset();
+      XDestroyWindow(ctx.d, overlay.window);
+   }
+   overlays.clear();
+}
+
+// The overlay to keep frame timing with: the one the pointer is on
+const Overlay &overlay_at(const std::vector<Overlay> &overlays, int x, int y) {
+   for (const Overlay &overlay : overlays) {
+      if (rect_contains(overlay.area, {x, y, 1, 1})) {
+         return overlay;
+      }
+   }
+   return overlays.front();
+}
+
+bool overlays_ready(const std::vector<Overlay> &overlays) {
+   return std::all_of(overlays.begin(), overlays.end(),
+      [](const Overlay &overlay) { return overlay.renderer->ready(); });
+}
+
+// Keeps the overlays above every other window. The stacking order of the
+// root's children is followed from SubstructureNotify events, and a restack
+// is only asked for once a mapped window actually ends up above an overlay,
+// instead of every time some window gets created.
+class StackingManager {
+public:
+   StackingManager(WindowContext &ctx) : d(ctx.d), root(ctx.root) {}
+
+   // Freshly created overlays sit on top of everything
+   void reset(const std::vector<Overlay> &overlays) {
+      ours.clear();
+      for (const Overlay &overlay : overlays) {
+         ours.insert(overlay.window);
+      }
+      above.clear();
+      pending = false;
+   }
+
+   // Returns true if the event was about the stacking of the root's children
+   bool handle_event(const XEvent &event) {
+      switch (event.type) {
+      case CreateNotify:
+         if (event.xcreatewindow.parent != root) {
+            return false;
+         }
+         // New windows go on top, but can't cover anything until mapped
+         place_above(event.xcreatewindow.window);
+         unmapped.insert(event.xcreatewindow.window);
+         return true;
+      case MapNotify:
+         if (event.xmap.event != root) {
+            return false;
+         }
+         unmapped.erase(event.xmap.window);
+         check(event.xmap.window);
+         return true;
+      case UnmapNotify:
+         if (event.xunmap.event != root) {
+            return false;
+         }
+         unmapped.insert(event.xunmap.window);
+         return true;
+      case ConfigureNotify: {
+         const XConfigureEvent &e = event.xconfigure;
+         if (e.event != root || ours.count(e.window)) {
+            return e.event == root;
+         }
+         // `above` is the sibling the window is now directly on top of
+         if (e.above != None && (ours.count(e.above) || above.count(e.above))) {
+            place_above(e.window);
+            check(e.window);
+         } else {
+            above.erase(e.window);
+         }
+         return true;
+      }
+      case CirculateNotify:
+         if (event.xcirculate.event != root || ours.count(event.xcirculate.window)) {
+            return event.xcirculate.event == root;
+         }
+         if (event.xcirculate.place == PlaceOnTop) {
+            place_above(event.xcirculate.window);
+            check(event.xcirculate.window);
+         } else {
+            above.erase(event.xcirculate.window);
+         }
+         return true;
+      case ReparentNotify:
+         if (event.xreparent.event != root) {
+            return false;
+         }
+         if (event.xreparent.parent == root) {
+            // Reparented windows go on top; if mapped, a MapNotify follows
+            place_above(event.xreparent.window);
+            unmapped.insert(event.xreparent.window);
+         } else {
+            forget(event.xreparent.window);
+         }
+         return true;
+      case DestroyNotify:
+         if (event.xdestroywindow.event != root) {
+            return false;
+         }
+         forget(event.xdestroywindow.window);
+         return true;
+      default:
+         return false;
+      }
+   }
+
+   bool restack_needed() const {
+      return pending;
+   }
+
+   void restack(const std::vector<Overlay> &overlays) {
+      for (const Overlay &overlay : overlays) {
+         XRaiseWindow(d, overlay.window);
+      }
+      above.clear();
+      pending = false;
+   }
+
+private:
+   void place_above(Window window) {
+      if (!ours.count(window)) {
+         above.insert(window);
+      }
+   }
+
+   void check(Window window) {
+      if (above.count(window) && !unmapped.count(window)) {
+         pending = true;
+      }
+   }
+
+   void forget(Window window) {
+      above.erase(window);
+      unmapped.erase(window);
+   }
+
+   Display *d;
+   Window root;
+   std::unordered_set<Window> ours;
+   // Windows stacked above at least one overlay
+   std::unordered_set<Window> above;
+   // Windows known to be unmapped. Windows that existed before we started
+   // aren't tracked, and are assumed to be mapped.
+   std::unordered_set<Window> unmapped;
+   bool pending = false;
+};
+
+bool is_randr_event(const WindowContext &ctx, const XEvent &event) {
+   return ctx.randr_event_base >= 0 &&
+      (event.type == ctx.randr_event_base + RRScreenChangeNotify ||
+       event.type == ctx.randr_event_base + RRNotify);
+}
+
+// The trails of every master pointer. Normally there is just the one, but
+// with MPX each master device gets its own trail, in the next of the
+// configured colors. All of them are drawn in the same pass each frame, so a
+// pointer that isn't moving costs no more than its single dot.
+class PointerTrails {
+public:
+   PointerTrails(const PointerStyle &style, const std::vector<Color> &colors) :
+      style(style), colors(colors) {}
+
+   const std::vector<Trail> &all() const {
+      return trails;
+   }
+
+   // Starts a trail at `position` for a pointer that doesn't have one yet
+   void add(int deviceid, const Sample &position) {
+      if (find(deviceid) != NULL) {
+         return;
+      }
+      trails.emplace_back();
+      Trail &trail = trails.back();
+      trail.deviceid = deviceid;
+      trail.style = style;
+      trail.style.color = colors[next_color++ % colors.size()];
+      trail.history.push_back(position);
+   }
+
+   // Returns whether the pointer had a trail
+   bool remove(int deviceid) {
+      for (size_t i = 0; i < trails.size(); i++) {
+         if (trails[i].deviceid == deviceid) {
+            erased.push_back(trails[i].drawn_bounds);
+            trails.erase(trails.begin() + i);
+            return true;
+         }
+      }
+      return false;
+   }
+
+   // Returns whether the pointer moved
+   bool record(int deviceid, const Sample &sample) {
+      Trail *trail = find(deviceid);
+      if (trail == NULL) {
+         add(deviceid, sample);
+      } else if (!record_sample(trail->history, sample, trail->style)) {
+         return false;
+      }
+      active = deviceid;
+      if (!motion_undrawn) {
+         motion_undrawn = true;
+         undrawn_since = sample.time;
+      }
+      return true;
+   }
+
+   // Gets the server time of the oldest motion that hasn't been drawn yet,
+   // for --stats. Returns false if there was none.
+   bool take_undrawn_motion(uint32_t &time) {
+      bool undrawn = motion_undrawn;
+      time = undrawn_since;
+      motion_undrawn = false;
+      return undrawn;
+   }
+
+   // Replaces `damage` with what needs repainting this frame, in root
+   // coordinates: a few rectangles per moving pointer, plus wherever a
+   // removed pointer's trail was last drawn
+   void take_damage(uint32_t now, std::vector<Rect> &damage) {
+      damage.clear();
+      for (const Rect &rect : erased) {
+         add_damage(damage, rect);
+      }
+      erased.clear();
+      for (Trail &trail : trails) {
+         add_trail_damage(trail, now, damage);
+      }
+   }
+
+   void expire(uint32_t now) {
+      for (Trail &trail : trails) {
+         expire_samples(trail.history, now, trail.style);
+      }
+   }
+
+   // Whether any trail still has something left to fade out
+   bool fading() const {
+      for (const Trail &trail : trails) {
+         if (trail.history.size() > 1) {
+            return true;
+         }
+      }
+      return false;
+   }
+
+   // The pointer that moved most recently, or NULL if there are none
+   const Trail *active_trail() const {
+      for (const Trail &trail : trails) {
+         if (trail.deviceid == active) {
+            return &trail;
+         }
+      }
+      return trails.empty() ? NULL : &trails.front();
+   }
+
+private:
+   Trail *find(int deviceid) {
+      for (Trail &trail : trails) {
+         if (trail.deviceid == deviceid) {
+            return &trail;
+         }
+      }
+      return NULL;
+   }
+
+   PointerStyle style;
+   std::vector<Color> colors;
+   size_t next_color = 0;
+   std::vector<Trail> trails;
+   // Where the trails of removed pointers were last drawn
+   std::vector<Rect> erased;
+   int active = -1;
+   bool motion_undrawn = false;
+   uint32_t undrawn_since = 0;
+};
+
+// Gives every master pointer that exists at startup a trail, starting with
+// the client pointer so that it gets the first color. `time` is the current
+// server time.
+void add_master_pointers(WindowContext &ctx, PointerTrails &pointers, uint32_t time) {
+   int client_pointer;
+   XIGetClientPointer(ctx.d, None, &client_pointer);
+   Sample position;
+   if (query_pointer(ctx, client_pointer, time, position)) {
+      pointers.add(client_pointer, position);
+   }
+
+   int count;
+   XIDeviceInfo *devices = XIQueryDevice(ctx.d, XIAllMasterDevices, &count);
+   for (int i = 0; i < count; i++) {
+      if (devices[i].use == XIMasterPointer &&
+          query_pointer(ctx, devices[i].deviceid, time, position)) {
+         pointers.add(devices[i].deviceid, position);
+      }
+   }
+   XIFreeDeviceInfo(devices);
+}
+
+// Raw motion still waiting for its position to be looked up
+struct PendingRawMotion {
+   int deviceid;
+   uint32_t time;
+};
+
+void forget_raw_motion(std::vector<PendingRawMotion> &raw_motion, int deviceid) {
+   raw_motion.erase(std::remove_if(raw_motion.begin(), raw_motion.end(),
+      [&](const PendingRawMotion &raw) { return raw.deviceid == deviceid; }),
+      raw_motion.end());
+}
+
+// Feeds an XI2 motion or hierarchy event into the pointer trails. Returns
+// whether any trail changed.
+//
+// XI_Motion is only delivered to the root window while no other client has
+// selected motion on the window under the pointer, so most movement shows up
+// as XI_RawMotion alone. Raw events carry a timestamp but no position; those
+// are left in `raw_motion`, at most one per pointer, for the caller to
+// resolve with a query each once the event queue has been drained.
+bool handle_motion_event(WindowContext &ctx, XEvent &event, PointerTrails &pointers,
+                         ServerClock &server_clock,
+                         std::vector<PendingRawMotion> &raw_motion) {
+   XGenericEventCookie *cookie = &event.xcookie;
+   if (cookie->type != GenericEvent || cookie->extension != ctx.xi_opcode ||
+       !XGetEventData(ctx.d, cookie)) {
+      return false;
+   }
+
+   bool changed = false;
+   if (cookie->evtype == XI_Motion) {
+      XIDeviceEvent *e = (XIDeviceEvent *) cookie->data;
+      server_clock.observe(e->time);
+      Sample sample = {(int) std::lround(e->root_x), (int) std::lround(e->root_y),
+                       (uint32_t) e->time};
+      changed = pointers.record(e->deviceid, sample);
+      forget_raw_motion(raw_motion, e->deviceid);
+   } else if (cookie->evtype == XI_RawMotion) {
+      XIRawEvent *e = (XIRawEvent *) cookie->data;
+      server_clock.observe(e->time);
+      forget_raw_motion(raw_motion, e->deviceid);
+      raw_motion.push_back({e->deviceid, (uint32_t) e->time});
+   } else if (cookie->evtype == XI_HierarchyChanged) {
+      XIHierarchyEvent *e = (XIHierarchyEvent *) cookie->data;
+      for (int i = 0; i < e->num_info; i++) {
+         const XIHierarchyInfo &info = e->info[i];
+         Sample position;
+         if ((info.flags & XIMasterAdded) && info.use == XIMasterPointer) {
+            if (query_pointer(ctx, info.deviceid, e->time, position)) {
+               pointers.add(info.deviceid, position);
+               changed = true;
+            }
+         } else if (info.flags & XIMasterRemoved) {
+            // take_damage() covers the removed trail in the next frame
+            changed = pointers.remove(info.deviceid) || changed;
+            forget_raw_motion(raw_motion, info.deviceid);
+         }
+      }
+   }
+
+   XFreeEventData(ctx.d, cookie);
+   return changed;
 }
 
 int main(int argc, const char **argv) {
    double ptr_size = 7.0;
-   Color ptr_color = {1,0,0,1};
+   // Red for the first pointer; with MPX, further pointers go through the rest
+   std::vector<Color> ptr_colors = {
+      {1,0,0,1}, {0,0.5,1,1}, {0,0.75,0,1}, {1,0.6,0,1}, {0.8,0,0.8,1},
+   };
    int trail_length = 10;
 
    argagg::parser argparser {{
       { "help", {"-h", "--help"},
       "shows this help message", 0},
       { "color", {"-c", "--color"},
-      "color of the laser pointer (default: red)", 1},
+      "color of the laser pointer (default: red). Give it more than once "
+      "to set the colors of further pointers when using multiple master "
+      "pointers (MPX); they are used in turn. The shape backend draws every "
+      "pointer in the first color", 1},
       { "size", {"-s", "--size"},
       "radius of the laser pointer in pixels (default: 7)", 1},
       { "trail", {"-t", "--trail"},
-      "length of pointer trail (default: 10)", 1},
+      "length of pointer trail, in hundredths of a second (default: 10)", 1},
       { "showcursor", {"--cursor"},
       "don't hide the default X11 cursor", 0},
+      { "backend", {"-b", "--backend"},
+      "how to draw the pointer: cairo (antialiased, needs a compositing "
+      "window manager), xrender (like cairo, but composites pre-rendered "
+      "dots on the server, which is cheaper for long trails) or shape "
+      "(works without a compositor, but has no antialiasing or "
+      "transparency). shm is the cairo backend drawing into memory shared "
+      "with a local X server; it falls back to cairo on remote displays. "
+      "The default picks cairo or shape based on whether a compositor is "
+      "running", 1},
+      { "compact", {"--compact"},
+      "use a small overlay window that follows the pointer instead of "
+      "one covering each monitor", 0},
+      { "stats", {"--stats"},
+      "collect frame timing statistics, and print a summary on SIGUSR1 "
+      "and at exit", 0},
    }};
    argagg::parser_results args;
    try {
@@ -262,76 +1760,271 @@ int main(int argc, const char **argv) {
    }
 
    if (args["color"]) {
-      std::string color_str = args["color"];
-      if (auto color = CSSColorParser::parse(color_str)){      
-         ptr_color.r = (*color).r/255.0;
-         ptr_color.g = (*color).g/255.0;
-         ptr_color.b = (*color).b/255.0;
-         ptr_color.a = (*color).a;
+      ptr_colors.clear();
+      for (const argagg::option_result &option : args["color"].all) {
+         std::string color_str = option;
+         if (auto color = CSSColorParser::parse(color_str)){
+            ptr_colors.push_back({(*color).r/255.0, (*color).g/255.0,
+                                  (*color).b/255.0, (*color).a});
+         } else {
+            argagg::fmt_ostream fmt(std::cerr);
+            fmt << "ERROR: Invalid color" << std::endl;
+            return EXIT_FAILURE;
+         }
+      }
+   }
+
+   WindowContext ctx = initialize_xlib();
+
+   Backend backend;
+   if (args["backend"]) {
+      std::string backend_str = args["backend"];
+      if (backend_str == "cairo") {
+         backend = Backend::Cairo;
+      } else if (backend_str == "shape") {
+         backend = Backend::Shape;
+      } else if (backend_str == "xrender") {
+         backend = Backend::XRender;
+      } else if (backend_str == "shm") {
+         backend = Backend::Shm;
       } else {
          argagg::fmt_ostream fmt(std::cerr);
-         fmt << "ERROR: Invalid color" << std::endl;
+         fmt << "ERROR: Backend must be one of: cairo, xrender, shm, shape" << std::endl;
          return EXIT_FAILURE;
       }
+   } else {
+      backend = choose_backend(ctx);
    }
 
-   WindowContext ctx = initialize_xlib();
-   initialize_window(ctx);
-   CairoContext cairoCtx = initialize_cairo(ctx);
+   bool compact = args["compact"];
+   initialize_root(ctx, backend, ptr_colors[0]);
 
+   initialize_wakeup_pipe();
    signal(SIGINT, signalHandler);
 
+   std::unique_ptr<FrameStats> stats;
+   if (args["stats"]) {
+      stats.reset(new FrameStats());
+      signal(SIGUSR1, statsSignalHandler);
+   }
+
    if (!args["showcursor"]) {
-      XFixesHideCursor(ctx.d, ctx.overlay);
+      // The server hides the cursor for the whole screen the window is on,
+      // so use the root in case a compact overlay isn't under the pointer
+      XFixesHideCursor(ctx.d, ctx.root);
    }
 
-   std::deque<Coordinate> pointer_history(1);
-   int cooldown_timer = 0;
+   PointerStyle style = {ptr_size, ptr_colors[0], (uint32_t) trail_length * 10};
+
+   // The pointers' starting positions are stamped with a real server time,
+   // so that they age and wrap around like any other sample
+   ServerClock server_clock;
+   uint32_t start_time = query_server_time(ctx);
+   server_clock.observe(start_time);
+   PointerTrails pointers(style, ptr_colors);
+   add_master_pointers(ctx, pointers, start_time);
+   std::vector<PendingRawMotion> raw_motion;
+
+   FramePacer pacer(ctx);
+   std::vector<Monitor> monitors = query_monitors(ctx);
+   std::vector<Overlay> overlays = create_overlays(ctx, monitors, compact, pacer);
+   StackingManager stacking(ctx);
+   stacking.reset(overlays);
+
+   // Frames are only drawn while the trail still has something left to fade
+   // out; once only the pointer itself is left the loop sleeps until the
+   // next X event
+   bool frame_pending = true;
+
+   // Restacks are limited to one per refresh period
+   Clock::time_point last_restack;
+
+   // Reused from frame to frame, in root coordinates
+   std::vector<Rect> damage;
+   std::vector<Rect> overlay_damage;
 
    while (!shouldExit) {
-      Coordinate current = getPointerCoords(ctx);
-      bool changed = current == pointer_history.back();
-      pointer_history.push_back(current);
-      if (pointer_history.size() > trail_length) {
-         pointer_history.pop_front();
+      bool moved = false;
+      bool layout_changed = false;
+      raw_motion.clear();
+      // Recorded with the frame this wakeup leads to, if any, for --stats
+      int queue_depth = XPending(ctx.d);
+      while (XPending(ctx.d)) {
+         XEvent event;
+         XNextEvent(ctx.d, &event);
+         bool consumed = pacer.handle_event(event, Clock::now());
+         for (Overlay &overlay : overlays) {
+            consumed = consumed || overlay.renderer->handle_event(event);
+         }
+         if (consumed) {
+            continue;
+         } else if (is_randr_event(ctx, event)) {
+            XRRUpdateConfiguration(&event);
+            layout_changed = true;
+         } else if (stacking.handle_event(event)) {
+            continue;
+         } else if (handle_motion_event(ctx, event, pointers,
+                                        server_clock, raw_motion)) {
+            moved = true;
+         }
       }
 
-      draw(cairoCtx.cr, pointer_history, ptr_size, ptr_color);
-      XFlush(ctx.d);
+      for (const PendingRawMotion &raw : raw_motion) {
+         // The pointer may have been removed since the event was queued
+         Sample sample;
+         if (query_pointer(ctx, raw.deviceid, raw.time, sample) &&
+             pointers.record(raw.deviceid, sample)) {
+            moved = true;
+         }
+      }
 
-      if (cooldown_timer == 0) {
+      if (layout_changed) {
+         // A monitor was plugged in, unplugged or rearranged
+         ctx.screen_w = DisplayWidth(ctx.d, DefaultScreen(ctx.d));
+         ctx.screen_h = DisplayHeight(ctx.d, DefaultScreen(ctx.d));
+         destroy_overlays(ctx, overlays);
+         monitors = query_monitors(ctx);
+         overlays = create_overlays(ctx, monitors, compact, pacer);
+         stacking.reset(overlays);
+         frame_pending = true;
+      }
 
-         bool potential_overlap = false;
-         XEvent event;
-         while(XEventsQueued(ctx.d, QueuedAlready) > 1) {
-            XNextEvent(ctx.d, &event);
-            if (event.type == CreateNotify) {
-               potential_overlap = true;
+      if (moved) {
+         frame_pending = true;
+      }
+
+      // With several pointers, frames are paced to the monitor of whichever
+      // moved last
+      if (const Trail *active = pointers.active_trail()) {
+         const Sample &pointer = active->history.back();
+         pacer.follow(overlay_at(overlays, pointer.x, pointer.y).window,
+            monitor_at(monitors, pointer.x, pointer.y));
+      }
+
+      Clock::time_point now = Clock::now();
+      if (frame_pending) {
+         pacer.request_frame(now);
+      }
+
+      bool draw_frame = pacer.due(now) && overlays_ready(overlays);
+
+      // While frames are being drawn, restacking waits for the next one, so
+      // a burst of popups costs at most one restack per frame. When idle it
+      // is held to the same rate, so a client that keeps raising itself over
+      // us can't turn it into a raise war.
+      Clock::time_point restack_at = last_restack + pacer.frame_period();
+      if (stacking.restack_needed() &&
+          (draw_frame || (!frame_pending && now >= restack_at))) {
+         stacking.restack(overlays);
+         last_restack = now;
+         if (stats) {
+            stats->restacks++;
+         }
+      }
+
+      if (draw_frame) {
+         uint32_t server_now = server_clock.now();
+         pointers.expire(server_now);
+
+         // Only overlays that a trail is on, or was on last frame, are
+         // touched; the rest of the monitors are left alone
+         pointers.take_damage(server_now, damage);
+         Clock::time_point draw_start = Clock::now();
+         for (Overlay &overlay : overlays) {
+            if (compact && follow_trail(ctx, overlay,
+                   trails_bounds(pointers.all(), server_now), style.size)) {
+               overlay.repaint = true;
+            }
+            overlay_damage.clear();
+            if (overlay.repaint) {
+               overlay_damage.push_back(overlay.area);
+               overlay.repaint = false;
+            } else {
+               for (const Rect &rect : damage) {
+                  add_damage(overlay_damage, rect_intersect(rect, overlay.area));
+               }
+            }
+            if (overlay_damage.empty()) {
+               continue;
             }
+            overlay.renderer->draw(pointers.all(), server_now, overlay_damage);
          }
-         XNextEvent(ctx.d, &event);
-         if (event.type == CreateNotify) {
-            potential_overlap = true;
+         Clock::time_point flush_start = Clock::now();
+         XFlush(ctx.d);
+         Clock::time_point flush_end = Clock::now();
+         pacer.frame_drawn(now, flush_end);
+
+         if (stats) {
+            stats->frames++;
+            stats->queue_depth.record(queue_depth);
+            stats->draw_time.record(micros_between(draw_start, flush_start));
+            stats->flush_time.record(micros_between(flush_start, flush_end));
+            // Measured from when the server stamped the motion, so time
+            // spent queued in the server and the socket counts too
+            uint32_t motion_time;
+            if (pointers.take_undrawn_motion(motion_time)) {
+               int32_t ms = std::max((int32_t) (server_clock.now() - motion_time), 0);
+               stats->motion_to_draw.record((uint64_t) ms * 1000);
+            }
          }
 
-         if (potential_overlap) {
-            // This is a sketchy hack to make sure our overlay appears
-            // on top of menu/popup windows.
-            XUnmapWindow(ctx.d, ctx.overlay);
-            XMapWindow(ctx.d, ctx.overlay);
+         frame_pending = pointers.fading();
+      }
+      XFlush(ctx.d);
+
+      if (XPending(ctx.d) || shouldExit) {
+         continue;
+      }
+
+      // A renderer that isn't ready is waiting on an X event, which will wake
+      // the loop by itself
+      struct timespec timeout;
+      struct timespec *timeout_ptr = NULL;
+      Clock::time_point deadline;
+      bool wake = overlays_ready(overlays) && pacer.next_deadline(deadline);
+      if (stacking.restack_needed() && !frame_pending) {
+         restack_at = last_restack + pacer.frame_period();
+         if (!wake || restack_at < deadline) {
+            deadline = restack_at;
+            wake = true;
          }
+      }
+      if (wake) {
+         auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            deadline - Clock::now());
+         long long ns = std::max((long long) remaining.count(), 0LL);
+         timeout.tv_sec = ns / 1000000000;
+         timeout.tv_nsec = ns % 1000000000;
+         timeout_ptr = &timeout;
+      }
 
-         cooldown_timer = trail_length;
-      } else {
-         std::this_thread::sleep_for(std::chrono::milliseconds(10));
-         cooldown_timer--;
+      struct pollfd fds[2] = {
+         {ConnectionNumber(ctx.d), POLLIN, 0},
+         {wakeup_pipe[0], POLLIN, 0},
+      };
+      Clock::time_point idle_start = Clock::now();
+      ppoll(fds, 2, timeout_ptr, NULL);
+      if (stats) {
+         stats->idle_us += micros_between(idle_start, Clock::now());
+      }
+      if (fds[1].revents & POLLIN) {
+         drain_wakeup_pipe();
+      }
+
+      if (stats && shouldDumpStats) {
+         shouldDumpStats = false;
+         print_stats(*stats);
       }
    }
 
-   cairo_destroy(cairoCtx.cr);
-   cairo_surface_destroy(cairoCtx.surf);
+   if (stats) {
+      print_stats(*stats);
+   }
 
-   XUnmapWindow(ctx.d, ctx.overlay);
+   destroy_overlays(ctx, overlays);
    XCloseDisplay(ctx.d);
+
+   close(wakeup_pipe[0]);
+   close(wakeup_pipe[1]);
    return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,157 @@
+/*
+ * xlaserpointer
+ * Pointer trail bookkeeping, independent of X11 and of how it gets drawn.
+ *
+ * Copyright (C) 2020, Naomi Alterman
+ *
+ * Licensed under the MIT license; see main.cpp for the full text.
+ */
+#include "trail.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+Rect rect_union(const Rect &a, const Rect &b) {
+   if (a.empty()) {
+      return b;
+   }
+   if (b.empty()) {
+      return a;
+   }
+   int x0 = std::min(a.x, b.x);
+   int y0 = std::min(a.y, b.y);
+   int x1 = std::max(a.x + a.w, b.x + b.w);
+   int y1 = std::max(a.y + a.h, b.y + b.h);
+   return {x0, y0, x1 - x0, y1 - y0};
+}
+
+Rect rect_intersect(const Rect &a, const Rect &b) {
+   int x0 = std::max(a.x, b.x);
+   int y0 = std::max(a.y, b.y);
+   int x1 = std::min(a.x + a.w, b.x + b.w);
+   int y1 = std::min(a.y + a.h, b.y + b.h);
+   return {x0, y0, std::max(x1 - x0, 0), std::max(y1 - y0, 0)};
+}
+
+bool rect_contains(const Rect &outer, const Rect &inner) {
+   return inner.x >= outer.x && inner.y >= outer.y &&
+      inner.x + inner.w <= outer.x + outer.w &&
+      inner.y + inner.h <= outer.y + outer.h;
+}
+
+Rect rect_grow(const Rect &r, int margin) {
+   return {r.x - margin, r.y - margin, r.w + 2*margin, r.h + 2*margin};
+}
+
+bool color_equal(const Color &a, const Color &b) {
+   return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+bool rect_equal(const Rect &a, const Rect &b) {
+   return a.x == b.x && a.y == b.y && a.w == b.w && a.h == b.h;
+}
+
+void add_damage(std::vector<Rect> &damage, const Rect &rect) {
+   if (rect.empty()) {
+      return;
+   }
+   Rect merged = rect;
+   for (size_t i = 0; i < damage.size();) {
+      if (rect_intersect(damage[i], merged).empty()) {
+         i++;
+         continue;
+      }
+      merged = rect_union(merged, damage[i]);
+      damage.erase(damage.begin() + i);
+      // The grown rectangle may now overlap ones already passed over
+      i = 0;
+   }
+   damage.push_back(merged);
+}
+
+int32_t sample_age(const Sample &sample, uint32_t now) {
+   // Server time wraps every ~49 days; unsigned subtraction keeps this right
+   int32_t age = (int32_t) (now - sample.time);
+   if (age >= 0) {
+      return age;
+   }
+   // Our estimate of the server's time can trail an event by a few
+   // milliseconds. Anything further "ahead" than that is really a sample
+   // from more than 24 days ago, whose age no longer fits.
+   return age > -max_clock_skew_ms ? 0 : INT32_MAX;
+}
+
+double dot_radius(const MotionHistory &history, size_t i, uint32_t now,
+                  const PointerStyle &style) {
+   if (i + 1 == history.size()) {
+      return style.size;
+   }
+   double remaining = 1.0 - (double) sample_age(history[i], now) / style.trail_ms;
+   return style.size * remaining;
+}
+
+void expire_samples(MotionHistory &history, uint32_t now, const PointerStyle &style) {
+   while (history.size() > 1 &&
+          sample_age(history.front(), now) >= (int32_t) style.trail_ms) {
+      history.pop_front();
+   }
+}
+
+uint32_t sample_spacing_ms(const PointerStyle &style) {
+   // The newest sample can be up to a spacing newer than the rest suggest
+   uint32_t slots = (uint32_t) MotionHistory::capacity() - 2;
+   return std::max((style.trail_ms + slots - 1) / slots, 1u);
+}
+
+bool record_sample(MotionHistory &history, const Sample &sample,
+                   const PointerStyle &style) {
+   if (history.empty()) {
+      history.push_back(sample);
+      return true;
+   }
+   Sample &newest = history.back();
+   if (newest.x == sample.x && newest.y == sample.y) {
+      return false;
+   }
+   // The timestamp stays put, or a fast enough mouse would never let the
+   // newest sample age into a new one
+   if ((int32_t) (sample.time - newest.time) < (int32_t) sample_spacing_ms(style)) {
+      newest.x = sample.x;
+      newest.y = sample.y;
+      return true;
+   }
+   history.push_back(sample);
+   return true;
+}
+
+Rect trail_bounds(const MotionHistory &history, uint32_t now, const PointerStyle &style) {
+   Rect bounds = {0, 0, 0, 0};
+   for (size_t i = 0; i < history.size(); i++) {
+      double radius = dot_radius(history, i, now, style);
+      if (radius <= 0) {
+         continue;
+      }
+      const Sample &s = history[i];
+      int pad = (int) std::ceil(radius) + 1;
+      bounds = rect_union(bounds, {s.x - pad, s.y - pad, 2*pad, 2*pad});
+   }
+   return bounds;
+}
+
+Rect trails_bounds(const std::vector<Trail> &trails, uint32_t now) {
+   Rect bounds = {0, 0, 0, 0};
+   for (const Trail &trail : trails) {
+      bounds = rect_union(bounds, trail_bounds(trail.history, now, trail.style));
+   }
+   return bounds;
+}
+
+void add_trail_damage(Trail &trail, uint32_t now, std::vector<Rect> &damage) {
+   Rect bounds = trail_bounds(trail.history, now, trail.style);
+   if (trail.history.size() == 1 && rect_equal(bounds, trail.drawn_bounds)) {
+      return;
+   }
+   add_damage(damage, trail.drawn_bounds);
+   add_damage(damage, bounds);
+   trail.drawn_bounds = bounds;
+}
@@ -0,0 +1,140 @@
+/*
+ * xlaserpointer
+ * Pointer trail bookkeeping, independent of X11 and of how it gets drawn.
+ *
+ * Copyright (C) 2020, Naomi Alterman
+ *
+ * Licensed under the MIT license; see main.cpp for the full text.
+ */
+#ifndef XLASERPOINTER_TRAIL_HPP
+#define XLASERPOINTER_TRAIL_HPP
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+struct Rect {
+   int x, y, w, h;
+   bool empty() const {
+      return w <= 0 || h <= 0;
+   }
+};
+
+Rect rect_union(const Rect &a, const Rect &b);
+Rect rect_intersect(const Rect &a, const Rect &b);
+bool rect_contains(const Rect &outer, const Rect &inner);
+Rect rect_grow(const Rect &r, int margin);
+bool rect_equal(const Rect &a, const Rect &b);
+
+// Adds `rect` to a list of damaged areas, merging it with any it overlaps so
+// that the rectangles in the list never overlap each other
+void add_damage(std::vector<Rect> &damage, const Rect &rect);
+
+// A pointer position in root window coordinates, stamped with the X server
+// time (in milliseconds) of the event that reported it
+struct Sample {
+   int x, y;
+   uint32_t time;
+};
+
+// Fixed-capacity FIFO that never allocates after construction. Pushing onto
+// a full buffer silently drops the oldest entry.
+template <typename T, size_t Capacity>
+class RingBuffer {
+public:
+   size_t size() const { return count; }
+   bool empty() const { return count == 0; }
+   bool full() const { return count == Capacity; }
+
+   // Index 0 is the oldest entry, size()-1 the newest
+   const T &operator[](size_t i) const { return items[(head + i) % Capacity]; }
+   const T &front() const { return (*this)[0]; }
+   const T &back() const { return (*this)[count - 1]; }
+   T &back() { return items[(head + count - 1) % Capacity]; }
+   static size_t capacity() { return Capacity; }
+
+   void push_back(const T &item) {
+      if (full()) {
+         pop_front();
+      }
+      items[(head + count) % Capacity] = item;
+      count++;
+   }
+
+   void pop_front() {
+      assert(count > 0);
+      head = (head + 1) % Capacity;
+      count--;
+   }
+
+private:
+   T items[Capacity];
+   size_t head = 0;
+   size_t count = 0;
+};
+
+// Enough for a few seconds of trail from a 1000Hz mouse
+typedef RingBuffer<Sample, 4096> MotionHistory;
+
+struct Color {
+   double r, g, b, a;
+};
+
+bool color_equal(const Color &a, const Color &b);
+
+struct PointerStyle {
+   double size;
+   Color color;
+   uint32_t trail_ms;
+};
+
+// The trail left by one master pointer. With MPX every master device has its
+// own, each normally in a different color.
+struct Trail {
+   int deviceid;
+   PointerStyle style;
+   MotionHistory history;
+   // trail_bounds() as of the last frame drawn
+   Rect drawn_bounds = {0, 0, 0, 0};
+};
+
+// How far ahead of `now` a sample may be stamped and still count as brand new
+const int32_t max_clock_skew_ms = 10000;
+
+// Milliseconds since the sample was taken, never negative
+int32_t sample_age(const Sample &sample, uint32_t now);
+
+// Dots shrink linearly as they age and vanish once they are trail_ms old.
+// The newest sample is where the pointer is now, so it is always full size.
+double dot_radius(const MotionHistory &history, size_t i, uint32_t now,
+                  const PointerStyle &style);
+
+// Drops samples whose dots have faded out, always keeping the newest
+void expire_samples(MotionHistory &history, uint32_t now, const PointerStyle &style);
+
+// The shortest time kept between two samples in the history: at least 1ms,
+// and long enough that a whole trail fits in the ring buffer
+uint32_t sample_spacing_ms(const PointerStyle &style);
+
+// Returns whether the sample actually moved the pointer. Samples arriving
+// less than sample_spacing_ms() after the newest one only move it, so the
+// number of dots in a trail doesn't depend on the mouse's polling rate.
+bool record_sample(MotionHistory &history, const Sample &sample,
+                   const PointerStyle &style);
+
+// Bounding box of every dot in the trail, padded by a pixel so that cairo's
+// antialiased edges are included in the damaged area
+Rect trail_bounds(const MotionHistory &history, uint32_t now, const PointerStyle &style);
+
+// Union of the bounds of every trail
+Rect trails_bounds(const std::vector<Trail> &trails, uint32_t now);
+
+// Adds what needs repainting for this trail to `damage`: where it was last
+// drawn and where it is now. A pointer sitting still adds nothing. Each trail
+// gets rectangles of its own, so pointers far apart on the same monitor don't
+// repaint everything between them. Updates trail.drawn_bounds.
+void add_trail_damage(Trail &trail, uint32_t now, std::vector<Rect> &damage);
+
+#endif